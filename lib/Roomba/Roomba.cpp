@@ -4,26 +4,266 @@
 // $Id: Roomba.cpp,v 1.1 2010/09/27 21:58:32 mikem Exp mikem $
 
 #include "Roomba.h"
+#include <stddef.h>
+
+// Encoding of each sensor packet ID, indexed by ID. Sizes come from the
+// SensorValues field types, which match the packet data.
+#define SENSOR_U(member) {sizeof(Roomba::SensorValues::member), 0, offsetof(Roomba::SensorValues, member)}
+#define SENSOR_S(member) {sizeof(Roomba::SensorValues::member), Roomba::SensorFieldSigned, offsetof(Roomba::SensorValues, member)}
+#define SENSOR_GROUP(size, first) {size, Roomba::SensorFieldGroup, first}
+#define SENSOR_UNUSED(size) {size, 0, ROOMBA_SENSOR_NO_FIELD}
+#define ROOMBA_SENSOR_NO_FIELD 0xff
+
+static const Roomba::SensorField sensorFields[] = {
+    SENSOR_GROUP(26, Roomba::SensorBumpsAndWheelDrops), // 0: 7-26
+    SENSOR_GROUP(10, Roomba::SensorBumpsAndWheelDrops), // 1: 7-16
+    SENSOR_GROUP(6, Roomba::SensorIRByte),              // 2: 17-20
+    SENSOR_GROUP(10, Roomba::SensorChargingState),      // 3: 21-26
+    SENSOR_GROUP(14, Roomba::SensorWallSignal),         // 4: 27-34
+    SENSOR_GROUP(12, Roomba::SensorOIMode),             // 5: 35-42
+    SENSOR_GROUP(52, Roomba::SensorBumpsAndWheelDrops), // 6: 7-42
+    SENSOR_U(bumpsAndWheelDrops),                       // 7
+    SENSOR_U(wall),                                     // 8
+    SENSOR_U(cliffLeft),                                // 9
+    SENSOR_U(cliffFrontLeft),                           // 10
+    SENSOR_U(cliffFrontRight),                          // 11
+    SENSOR_U(cliffRight),                               // 12
+    SENSOR_U(virtualWall),                              // 13
+    SENSOR_U(overcurrents),                             // 14
+    SENSOR_UNUSED(1),                                   // 15
+    SENSOR_UNUSED(1),                                   // 16
+    SENSOR_U(irByte),                                   // 17
+    SENSOR_U(buttons),                                  // 18
+    SENSOR_S(distance),                                 // 19
+    SENSOR_S(angle),                                    // 20
+    SENSOR_U(chargingState),                            // 21
+    SENSOR_U(voltage),                                  // 22
+    SENSOR_S(current),                                  // 23
+    SENSOR_S(temperature),                              // 24
+    SENSOR_S(charge),                                   // 25
+    SENSOR_U(capacity),                                 // 26
+    SENSOR_U(wallSignal),                               // 27
+    SENSOR_U(cliffLeftSignal),                          // 28
+    SENSOR_U(cliffFrontLeftSignal),                     // 29
+    SENSOR_U(cliffFrontRightSignal),                    // 30
+    SENSOR_U(cliffRightSignal),                         // 31
+    SENSOR_U(userDigitalInputs),                        // 32
+    SENSOR_U(userAnalogInput),                          // 33
+    SENSOR_U(chargingSources),                          // 34
+    SENSOR_U(oiMode),                                   // 35
+    SENSOR_U(songNumber),                               // 36
+    SENSOR_U(songPlaying),                              // 37
+    SENSOR_U(numberOfStreamPackets),                    // 38
+    SENSOR_S(velocity),                                 // 39
+    SENSOR_S(radius),                                   // 40
+    SENSOR_S(rightVelocity),                            // 41
+    SENSOR_S(leftVelocity),                             // 42
+    SENSOR_U(leftEncoderCounts),                        // 43
+    SENSOR_U(rightEncoderCounts),                       // 44
+    SENSOR_U(lightBumper),                              // 45
+    SENSOR_U(lightBumpLeftSignal),                      // 46
+    SENSOR_U(lightBumpFrontLeftSignal),                 // 47
+    SENSOR_U(lightBumpCenterLeftSignal),                // 48
+    SENSOR_U(lightBumpCenterRightSignal),               // 49
+    SENSOR_U(lightBumpFrontRightSignal),                // 50
+    SENSOR_U(lightBumpRightSignal),                     // 51
+    SENSOR_U(irOpcodeLeft),                             // 52
+    SENSOR_U(irOpcodeRight),                            // 53
+    SENSOR_S(leftMotorCurrent),                         // 54
+    SENSOR_S(rightMotorCurrent),                        // 55
+    SENSOR_S(mainBrushCurrent),                         // 56
+    SENSOR_S(sideBrushCurrent),                         // 57
+    SENSOR_U(stasis),                                   // 58
+};
+#define SENSOR_FIELD_COUNT (sizeof(sensorFields) / sizeof(sensorFields[0]))
+
+// Stores a decoded big-endian value into its SensorValues field
+static void storeSensorValue(const Roomba::SensorField* field, uint16_t value, Roomba::SensorValues* dest)
+{
+    if (field->field == ROOMBA_SENSOR_NO_FIELD)
+	return;
+    uint8_t* p = (uint8_t*)dest + field->field;
+    if (field->size == 1)
+	*p = value;
+    else
+	memcpy(p, &value, sizeof(value));
+}
 
 Roomba::Roomba(HardwareSerial* serial, Baud baud)
 {
-  _serial = serial;
+  _hardwareSerial = serial;
+  init(serial, baud);
+}
+
+Roomba::Roomba(Stream* stream, Baud baud)
+{
+  _hardwareSerial = NULL;
+  init(stream, baud);
+}
+
+void Roomba::init(Stream* stream, Baud baud)
+{
+  _serial = stream;
   _baud = baudCodeToBaudRate(baud);
   _pollState = PollStateIdle;
+  _pollFrameLength = 0;
+  _pollReplayIndex = 0;
+  _pollReplayLength = 0;
+  _streamIDCount = 0;
+  _streamSize = 0;
+  memset(&_pollShadow, 0, sizeof(_pollShadow));
+  memset(&_streamStats, 0, sizeof(_streamStats));
+  _requestHandle = 0;
+  _requestStatus = RequestStatusIdle;
+  _txLength = 0;
+  _txBatch = 0;
+}
+
+const Roomba::SensorField* Roomba::sensorField(uint8_t packetID)
+{
+    return packetID < SENSOR_FIELD_COUNT ? &sensorFields[packetID] : NULL;
+}
+
+uint8_t Roomba::sensorsDataSize(const uint8_t* packetIDs, uint8_t numPacketIDs)
+{
+    int size = 0;
+    for (uint8_t i = 0; i < numPacketIDs; i++)
+    {
+	const SensorField* field = sensorField(packetIDs[i]);
+	if (!field)
+	    return 0;
+	size += field->size;
+    }
+    return size > 255 ? 0 : size;
+}
+
+// Decodes the data for a single or group packet ID, returns its size
+static uint8_t decodeSensorPacket(uint8_t packetID, const uint8_t* data, Roomba::SensorValues* dest)
+{
+    const Roomba::SensorField* field = &sensorFields[packetID];
+    if (field->flags & Roomba::SensorFieldGroup)
+    {
+	uint8_t offset = 0;
+	for (uint8_t member = field->field; offset < field->size; member++)
+	    offset += decodeSensorPacket(member, data + offset, dest);
+    }
+    else
+	storeSensorValue(field, field->size == 1 ? data[0] : (data[0] << 8) | data[1], dest);
+    return field->size;
+}
+
+bool Roomba::decodeSensors(const uint8_t* packetIDs, uint8_t numPacketIDs, const uint8_t* data, uint8_t len, SensorValues* dest)
+{
+    if (len == 0 || sensorsDataSize(packetIDs, numPacketIDs) != len)
+	return false;
+    for (uint8_t i = 0; i < numPacketIDs; i++)
+	data += decodeSensorPacket(packetIDs[i], data, dest);
+    return true;
 }
 
 // Resets the
 void Roomba::reset()
 {
-    _serial->write(7);
+    sendByte(7);
+}
+
+void Roomba::setRxBufferSize(uint16_t size)
+{
+    _streamStats.rxBufferSize = size;
+}
+
+// Applies the receive buffer size, which the ESP8266 core wants before begin()
+void Roomba::beginSerial()
+{
+    if (!_hardwareSerial)
+	return; // Up to the caller
+#ifdef ESP8266
+    if (_streamStats.rxBufferSize)
+	_hardwareSerial->setRxBufferSize(_streamStats.rxBufferSize);
+#endif
+    _hardwareSerial->begin(_baud);
+}
+
+bool Roomba::checkRx()
+{
+    int available = _serial->available();
+    if (available > _streamStats.rxHighWater)
+	_streamStats.rxHighWater = available;
+#ifdef ESP8266
+    if (_hardwareSerial && _hardwareSerial->hasOverrun())
+    {
+	_streamStats.rxOverruns++;
+	return false;
+    }
+#endif
+    return true;
+}
+
+// Stages a complete command, then writes it out unless a batch is open
+void Roomba::send(const uint8_t* cmd, uint8_t len, const uint8_t* data, uint8_t dataLen)
+{
+    uint16_t total = len + dataLen;
+    if (_txLength + total > sizeof(_txBuffer))
+	flushTx();
+    if (total > sizeof(_txBuffer))
+    {
+	// Too long to stage, eg a full script
+	_serial->write(cmd, len);
+	if (dataLen)
+	    _serial->write(data, dataLen);
+	return;
+    }
+    memcpy(_txBuffer + _txLength, cmd, len);
+    if (dataLen)
+	memcpy(_txBuffer + _txLength + len, data, dataLen);
+    _txLength += total;
+    if (!_txBatch)
+	flushTx();
+}
+
+void Roomba::sendByte(uint8_t opcode)
+{
+    send(&opcode, 1);
+}
+
+// Queries go out straight away, even in a batch, since the caller is about to wait for the response
+void Roomba::sendQuery(const uint8_t* cmd, uint8_t len, const uint8_t* data, uint8_t dataLen)
+{
+    send(cmd, len, data, dataLen);
+    flushTx();
+}
+
+void Roomba::flushTx()
+{
+    if (_txLength)
+	_serial->write(_txBuffer, _txLength);
+    _txLength = 0;
+}
+
+void Roomba::beginBatch()
+{
+    _txBatch++;
+}
+
+void Roomba::commit()
+{
+    if (_txBatch)
+	_txBatch--;
+    if (!_txBatch)
+	flushTx();
+}
+
+void Roomba::write(const uint8_t* data, uint8_t len)
+{
+    send(data, len);
 }
 
 // Start OI
 // Changes mode to passive
 void Roomba::start()
 {
-    _serial->begin(_baud);
-    _serial->write(128);
+    beginSerial();
+    sendByte(128);
 }
 
 uint32_t Roomba::baudCodeToBaudRate(Baud baud)
@@ -61,188 +301,200 @@ uint32_t Roomba::baudCodeToBaudRate(Baud baud)
 
 void Roomba::baud(Baud baud)
 {
-    _serial->write(129);
-    _serial->write(baud);
+    uint8_t cmd[] = {129, (uint8_t)baud};
+    send(cmd, sizeof(cmd));
+    // The command has to go out at the old baud rate
+    flushTx();
+    _serial->flush();
 
     _baud = baudCodeToBaudRate(baud);
-    _serial->begin(_baud);
+    beginSerial();
+}
+
+bool Roomba::serialBaud(Baud baud)
+{
+    if (!_hardwareSerial)
+	return false;
+    _baud = baudCodeToBaudRate(baud);
+    beginSerial();
+    // Whatever was being decoded came in at the old rate
+    _pollState = PollStateIdle;
+    _pollReplayIndex = _pollReplayLength = 0;
+    return true;
 }
 
 void Roomba::safeMode()
 {
-  _serial->write(131);
+  sendByte(131);
 }
 
 void Roomba::fullMode()
 {
-  _serial->write(132);
+  sendByte(132);
 }
 
 void Roomba::power()
 {
-  _serial->write(133);
+  sendByte(133);
 }
 
 void Roomba::dock()
 {
-  _serial->write(143);
+  sendByte(143);
 }
 
 void Roomba::demo(Demo demo)
 {
-  _serial->write(136);
-  _serial->write(demo);
+  uint8_t cmd[] = {136, (uint8_t)demo};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::cover()
 {
-  _serial->write(135);
+  sendByte(135);
 }
 
 void Roomba::coverAndDock()
 {
-  _serial->write(143);
+  sendByte(143);
 }
 
 void Roomba::spot()
 {
-  _serial->write(134);
+  sendByte(134);
 }
 
 void Roomba::setDayTime(uint8_t dayOfWeek, uint8_t hour, uint8_t minute)
 {
-  _serial->write(168);
-  _serial->write(dayOfWeek);
-  _serial->write(hour);
-  _serial->write(minute);
+  uint8_t cmd[] = {168, dayOfWeek, hour, minute};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::drive(int16_t velocity, int16_t radius)
 {
-  _serial->write(137);
-  _serial->write((velocity & 0xff00) >> 8);
-  _serial->write(velocity & 0xff);
-  _serial->write((radius & 0xff00) >> 8);
-  _serial->write(radius & 0xff);
+  uint8_t cmd[] = {137, (uint8_t)((velocity & 0xff00) >> 8), (uint8_t)(velocity & 0xff),
+                   (uint8_t)((radius & 0xff00) >> 8), (uint8_t)(radius & 0xff)};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::driveDirect(int16_t leftVelocity, int16_t rightVelocity)
 {
-  _serial->write(145);
-  _serial->write((rightVelocity & 0xff00) >> 8);
-  _serial->write(rightVelocity & 0xff);
-  _serial->write((leftVelocity & 0xff00) >> 8);
-  _serial->write(leftVelocity & 0xff);
+  uint8_t cmd[] = {145, (uint8_t)((rightVelocity & 0xff00) >> 8), (uint8_t)(rightVelocity & 0xff),
+                   (uint8_t)((leftVelocity & 0xff00) >> 8), (uint8_t)(leftVelocity & 0xff)};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::leds(uint8_t leds, uint8_t powerColour, uint8_t powerIntensity)
 {
-  _serial->write(139);
-  _serial->write(leds);
-  _serial->write(powerColour);
-  _serial->write(powerIntensity);
+  uint8_t cmd[] = {139, leds, powerColour, powerIntensity};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::digitalOut(uint8_t out)
 {
-  _serial->write(147);
-  _serial->write(out);
+  uint8_t cmd[] = {147, (uint8_t)out};
+  send(cmd, sizeof(cmd));
 }
 
 // Sets PWM duty cycles on low side drivers
 void Roomba::pwmDrivers(uint8_t dutyCycle0, uint8_t dutyCycle1, uint8_t dutyCycle2)
 {
-  _serial->write(144);
-  _serial->write(dutyCycle2);
-  _serial->write(dutyCycle1);
-  _serial->write(dutyCycle0);
+  uint8_t cmd[] = {144, dutyCycle2, dutyCycle1, dutyCycle0};
+  send(cmd, sizeof(cmd));
 }
 
 // Sets low side driver outputs on or off
 void Roomba::drivers(uint8_t out)
 {
-  _serial->write(138);
-  _serial->write(out);
+  uint8_t cmd[] = {138, (uint8_t)out};
+  send(cmd, sizeof(cmd));
 }
 
 // Modulates low side driver 1 (pin 23 on Cargo Bay Connector)
 // with the given IR command
 void Roomba::sendIR(uint8_t data)
 {
-  _serial->write(151);
-  _serial->write(data);
+  uint8_t cmd[] = {151, (uint8_t)data};
+  send(cmd, sizeof(cmd));
 }
 
 // Define a song
 // Data is 2 bytes per note
 void Roomba::song(uint8_t songNumber, const uint8_t* data, int len)
 {
-    _serial->write(140);
-    _serial->write(songNumber);
-    _serial->write(len >> 1); // 2 bytes per note
-    _serial->write(data, len);
+    uint8_t cmd[] = {140, songNumber, (uint8_t)(len >> 1)}; // 2 bytes per note
+    send(cmd, sizeof(cmd), data, len);
 }
 
 void Roomba::playSong(uint8_t songNumber)
 {
-  _serial->write(141);
-  _serial->write(songNumber);
+  uint8_t cmd[] = {141, (uint8_t)songNumber};
+  send(cmd, sizeof(cmd));
 }
 
 // Start a stream of sensor data with the specified packet IDs in it
 void Roomba::stream(const uint8_t* packetIDs, int len)
 {
-  _serial->write(148);
-  _serial->write((uint8_t)len);
-  _serial->write(packetIDs, len);
+  uint8_t cmd[] = {148, (uint8_t)len};
+  send(cmd, sizeof(cmd), packetIDs, len);
+
+  // Remember what the frames should look like, so pollSensors() can spot false starts
+  _streamIDCount = 0;
+  _streamSize = 0;
+  if (len == 0 || len > ROOMBA_MAX_STREAM_IDS)
+    return;
+  // Each packet ID is followed by its data
+  int size = len + sensorsDataSize(packetIDs, len);
+  if (size == len || size > 255)
+    return; // Can't check frames we dont know the size of
+  memcpy(_streamIDs, packetIDs, len);
+  _streamIDCount = len;
+  _streamSize = size;
 }
 
 // One of StreamCommand*
 void Roomba::streamCommand(StreamCommand command)
 {
-  _serial->write(150);
-  _serial->write(command);
+  uint8_t cmd[] = {150, (uint8_t)command};
+  send(cmd, sizeof(cmd));
 }
 
 // Use len=0 to clear the script
 void Roomba::script(const uint8_t* script, uint8_t len)
 {
-  _serial->write(152);
-  _serial->write(len);
-  _serial->write(script, len);
+  uint8_t cmd[] = {152, len};
+  send(cmd, sizeof(cmd), script, len);
 }
 
 void Roomba::playScript()
 {
-  _serial->write(153);
+  sendByte(153);
 }
 
 // Each tick is 15ms
 void Roomba::wait(uint8_t ticks)
 {
-  _serial->write(155);
-  _serial->write(ticks);
+  uint8_t cmd[] = {155, (uint8_t)ticks};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::waitDistance(int16_t mm)
 {
-  _serial->write(156);
-  _serial->write((mm & 0xff00) >> 8);
-  _serial->write(mm & 0xff);
+  uint8_t cmd[] = {156, (uint8_t)((mm & 0xff00) >> 8), (uint8_t)(mm & 0xff)};
+  send(cmd, sizeof(cmd));
 }
 
 void Roomba::waitAngle(int16_t degrees)
 {
-  _serial->write(157);
-  _serial->write((degrees & 0xff00) >> 8);
-  _serial->write(degrees & 0xff);
+  uint8_t cmd[] = {157, (uint8_t)((degrees & 0xff00) >> 8), (uint8_t)(degrees & 0xff)};
+  send(cmd, sizeof(cmd));
 }
 
 // Can use the negative of an event type to wait for the inverse of an event
 void Roomba::waitEvent(EventType type)
 {
-  _serial->write(158);
-  _serial->write(type);
+  uint8_t cmd[] = {158, (uint8_t)type};
+  send(cmd, sizeof(cmd));
 }
 
 // Reads at most len bytes and stores them to dest
@@ -257,9 +509,10 @@ bool Roomba::getData(uint8_t* dest, uint8_t len)
     unsigned long startTime = millis();
     while (!_serial->available())
     {
-      // Look for a timeout
-      if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+      // Look for a timeout. Subtracting keeps working when millis() wraps around
+      if (millis() - startTime > ROOMBA_READ_TIMEOUT)
         return false; // Timed out
+      yield();
     }
     *dest++ = _serial->read();
   }
@@ -268,70 +521,186 @@ bool Roomba::getData(uint8_t* dest, uint8_t len)
 
 bool Roomba::getSensors(uint8_t packetID, uint8_t* dest, uint8_t len)
 {
-  _serial->write(142);
-  _serial->write(packetID);
+  uint8_t cmd[] = {142, packetID};
+  sendQuery(cmd, sizeof(cmd));
   return getData(dest, len);
 }
 
 bool Roomba::getSensorsList(uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len)
 {
-  _serial->write(149);
-  _serial->write(numPacketIDs);
-  _serial->write(packetIDs, numPacketIDs);
+  uint8_t cmd[] = {149, numPacketIDs};
+  sendQuery(cmd, sizeof(cmd), packetIDs, numPacketIDs);
   return getData(dest, len);
 }
 
-// Simple state machine to read sensor data and discard everything else
-bool Roomba::pollSensors(uint8_t* dest, uint8_t destSize, uint8_t *packetLen)
+// Feeds the decoder with the bytes of a broken frame being looked through again,
+// then with whatever is waiting on the serial port.
+bool Roomba::pollSensors(SensorValues* dest)
 {
-    while (_serial->available())
+    if (!checkRx() && _pollState != PollStateIdle)
+    {
+	// Part of the frame being decoded was lost, dont wait for its checksum to fail
+	_streamStats.frameErrors++;
+	_pollState = PollStateIdle;
+    }
+    if (_requestStatus == RequestStatusPending)
+    {
+	// The bytes coming in are the response, not the stream
+	serviceRequest();
+	return false;
+    }
+    for (;;)
     {
-	uint8_t ch = _serial->read();
-	switch (_pollState)
+	uint8_t ch;
+	if (_pollReplayIndex < _pollReplayLength)
+	    ch = _pollFrame[_pollReplayIndex++];
+	else
 	{
-	    case PollStateIdle:
-		if (ch == 19)
-		    _pollState = PollStateWaitCount;
-		break;
+	    _pollReplayIndex = _pollReplayLength = 0;
+	    if (!_serial->available())
+		return false;
+	    ch = _serial->read();
+	    _streamStats.bytes++;
+	}
+	if (pollByte(ch))
+	{
+	    *dest = _pollShadow;
+	    return true;
+	}
+    }
+}
 
-	    case PollStateWaitCount:
-		_pollChecksum = _pollSize = ch;
-		_pollCount = 0;
-		_pollState = PollStateWaitBytes;
+// State machine that decodes sensor data a byte at a time and discards everything else.
+// Values go to _pollShadow and are only used once the frame checksum passes.
+// Returns true when ch completed a good frame
+bool Roomba::pollByte(uint8_t ch)
+{
+    if (_pollState == PollStateIdle)
+    {
+	if (ch != 19)
+	    return false;
+	_pollChecksum = 0;
+	_pollFrameLength = 0;
+    }
+    // Keep the bytes of the frame, in case it has to be looked through again
+    if (_pollFrameLength < sizeof(_pollFrame))
+	_pollFrame[_pollFrameLength] = ch;
+    if (_pollFrameLength <= sizeof(_pollFrame))
+	_pollFrameLength++;
+    _pollChecksum += ch;
+    switch (_pollState)
+    {
+	case PollStateIdle:
+	    _pollState = PollStateWaitCount;
+	    break;
+
+	case PollStateWaitCount:
+	    if (_streamIDCount && ch != _streamSize)
+	    {
+		// Not the frame we asked for, so that 19 was just data
+		_streamStats.frameErrors++;
+		pollRescan();
 		break;
-
-	    case PollStateWaitBytes:
-		_pollChecksum += ch;
-		if (_pollCount < destSize)
-		    dest[_pollCount] = ch;
-		if (_pollCount++ >= _pollSize)
-		    _pollState = PollStateWaitChecksum;
+	    }
+	    _pollSize = ch;
+	    _pollCount = 0;
+	    _pollIndex = 0;
+	    _pollState = _pollSize ? PollStateWaitID : PollStateWaitChecksum;
+	    break;
+
+	case PollStateWaitID:
+	    if (!pollStartPacket(ch))
+	    {
+		_streamStats.frameErrors++;
+		pollRescan();
 		break;
-
-	    case PollStateWaitChecksum:
-		_pollChecksum += ch;
+	    }
+	    _pollState = PollStateWaitBytes;
+	    break;
+
+	case PollStateWaitBytes:
+	    _pollCount++;
+	    _pollValue = (_pollValue << 8) | ch;
+	    if (++_pollMemberCount == sensorFields[_pollMember].size)
+	    {
+		storeSensorValue(&sensorFields[_pollMember], _pollValue, &_pollShadow);
+		_pollMember++;
+		_pollMemberCount = 0;
+		_pollValue = 0;
+	    }
+	    if (--_pollRemaining == 0)
+		_pollState = (_pollCount == _pollSize) ? PollStateWaitChecksum : PollStateWaitID;
+	    break;
+
+	case PollStateWaitChecksum:
+	    if (_pollChecksum == 0)
+	    {
 		_pollState = PollStateIdle;
-		*packetLen = _pollSize;
-		return (_pollChecksum == 0);
-		break;
-	}
+		_streamStats.frames++;
+		return true;
+	    }
+	    _streamStats.checksumErrors++;
+	    pollRescan();
+	    break;
     }
     return false;
 }
 
+bool Roomba::pollStartPacket(uint8_t packetID)
+{
+    const SensorField* field = sensorField(packetID);
+    if (!field || _pollCount + 1 + field->size > _pollSize)
+	return false;
+    if (_streamIDCount && (_pollIndex >= _streamIDCount || _streamIDs[_pollIndex] != packetID))
+	return false;
+    _pollCount++;
+    _pollIndex++;
+    _pollRemaining = field->size;
+    _pollMember = (field->flags & SensorFieldGroup) ? field->field : packetID;
+    _pollMemberCount = 0;
+    _pollValue = 0;
+    return true;
+}
+
+// The frame being decoded is broken, so the 19 it started with was just data.
+// Any later 19 in it, up to and including the byte that broke it, could be the start
+// of the real frame, so dont wait for the next stream period: feed the bytes from the
+// next 19 on through the decoder again, ahead of any still to be looked through.
+// The frame is always written behind where it is replayed from, so it fits in _pollFrame.
+void Roomba::pollRescan()
+{
+    _pollState = PollStateIdle;
+    if (_pollFrameLength > sizeof(_pollFrame))
+	return; // Too long to have been kept, wait for the next 19 on the serial port
+    uint8_t start = 1;
+    while (start < _pollFrameLength && _pollFrame[start] != 19)
+	start++;
+    uint8_t candidates = _pollFrameLength - start;
+    if (!candidates)
+	return;
+    uint8_t pending = _pollReplayLength - _pollReplayIndex;
+    memmove(_pollFrame, _pollFrame + start, candidates);
+    memmove(_pollFrame + candidates, _pollFrame + _pollReplayIndex, pending);
+    _pollReplayIndex = 0;
+    _pollReplayLength = candidates + pending;
+    _streamStats.rescans++;
+}
+
 // Returns the number of bytes in the script, or 0 on errors
 // Only saves at most len bytes to dest
 // Calling with len = 0 will return the amount of space required without actually storing anything
 uint8_t Roomba::getScript(uint8_t* dest, uint8_t len)
 {
-  _serial->write(154);
+  uint8_t cmd = 154;
+  sendQuery(&cmd, 1);
 
   unsigned long startTime = millis();
   while (!_serial->available())
   {
     // Look for a timeout
-    if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+    if (millis() - startTime > ROOMBA_READ_TIMEOUT)
       return 0; // Timed out
+    yield();
   }
 
   int count = _serial->read();
@@ -346,8 +715,9 @@ uint8_t Roomba::getScript(uint8_t* dest, uint8_t len)
     while (!_serial->available())
     {
       // Look for a timeout
-      if (millis() > startTime + ROOMBA_READ_TIMEOUT)
+      if (millis() - startTime > ROOMBA_READ_TIMEOUT)
         return 0; // Timed out
+      yield();
     }
     uint8_t data = _serial->read();
     if (i < len)
@@ -356,3 +726,107 @@ uint8_t Roomba::getScript(uint8_t* dest, uint8_t len)
 
   return count;
 }
+
+uint8_t Roomba::requestSensors(uint8_t packetID, uint8_t* dest, uint8_t len, RequestCallback callback, uint16_t timeout)
+{
+  if (_requestStatus == RequestStatusPending)
+    return 0;
+  uint8_t cmd[] = {142, packetID};
+  sendQuery(cmd, sizeof(cmd));
+  return startRequest(dest, len, len, false, callback, timeout);
+}
+
+uint8_t Roomba::requestSensorsList(const uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len, RequestCallback callback, uint16_t timeout)
+{
+  if (_requestStatus == RequestStatusPending)
+    return 0;
+  uint8_t cmd[] = {149, numPacketIDs};
+  sendQuery(cmd, sizeof(cmd), packetIDs, numPacketIDs);
+  return startRequest(dest, len, len, false, callback, timeout);
+}
+
+uint8_t Roomba::requestScript(uint8_t* dest, uint8_t len, RequestCallback callback, uint16_t timeout)
+{
+  if (_requestStatus == RequestStatusPending)
+    return 0;
+  uint8_t cmd = 154;
+  sendQuery(&cmd, 1);
+  return startRequest(dest, len, 0, true, callback, timeout);
+}
+
+uint8_t Roomba::startRequest(uint8_t* dest, uint8_t len, uint8_t expected, bool script, RequestCallback callback, uint16_t timeout)
+{
+  // 0 is never a valid handle
+  if (++_requestHandle == 0)
+    _requestHandle = 1;
+  _requestStatus = RequestStatusPending;
+  _requestDest = dest;
+  _requestLen = len;
+  _requestExpected = expected;
+  _requestCount = 0;
+  _requestScript = script;
+  _requestTimeout = timeout;
+  _requestStart = millis();
+  _requestCallback = callback;
+  if (!script && expected == 0)
+    finishRequest(RequestStatusDone);
+  return _requestHandle;
+}
+
+Roomba::RequestStatus Roomba::pollRequest(uint8_t handle)
+{
+  if (handle == 0 || handle != _requestHandle)
+    return RequestStatusIdle;
+  if (_requestStatus == RequestStatusPending)
+    serviceRequest();
+  return (RequestStatus)_requestStatus;
+}
+
+void Roomba::cancelRequest()
+{
+  if (_requestStatus == RequestStatusPending)
+    _requestStatus = RequestStatusIdle;
+}
+
+// Never blocks, reads what has arrived and leaves the rest for the next call
+void Roomba::serviceRequest()
+{
+  while (_serial->available())
+  {
+    uint8_t ch = _serial->read();
+    if (_requestScript)
+    {
+      // First byte of a script response is its length
+      if (ch > 100)
+      {
+	finishRequest(RequestStatusError); // Cant have such big scripts!!
+	return;
+      }
+      _requestExpected = ch;
+      _requestScript = false;
+      if (ch == 0)
+      {
+	finishRequest(RequestStatusDone);
+	return;
+      }
+      continue;
+    }
+    if (_requestCount < _requestLen)
+      _requestDest[_requestCount] = ch;
+    if (++_requestCount >= _requestExpected)
+    {
+      finishRequest(RequestStatusDone);
+      return;
+    }
+  }
+  // One deadline for the whole response. Subtracting keeps working when millis() wraps around
+  if (millis() - _requestStart > _requestTimeout)
+    finishRequest(RequestStatusTimedOut);
+}
+
+void Roomba::finishRequest(RequestStatus status)
+{
+  _requestStatus = status;
+  if (_requestCallback)
+    _requestCallback(_requestHandle, status, status == RequestStatusDone ? _requestExpected : _requestCount);
+}
@@ -129,6 +129,22 @@
 /// If we have to wait more than this to read a char when we are expecting one, then something is wrong.
 #define ROOMBA_READ_TIMEOUT 200
 
+/// \def ROOMBA_MAX_STREAM_IDS
+/// Max number of packet IDs in a stream() request that are remembered to validate the stream frames.
+/// Longer streams are still decoded, but without checking the frame size and IDs
+#define ROOMBA_MAX_STREAM_IDS 32
+
+/// \def ROOMBA_FRAME_BUFFER_SIZE
+/// Size of the buffer pollSensors() keeps the bytes of the frame being decoded in, so that a frame
+/// that turns out to be broken can be looked through for the real start of a frame. At most 254.
+/// Longer frames are still decoded, but after a bad one the decoder waits for the next 19 instead
+#define ROOMBA_FRAME_BUFFER_SIZE 128
+
+/// \def ROOMBA_TX_BUFFER_SIZE
+/// Size of the buffer commands are staged in before they are written to the serial port.
+/// Commands that do not fit in an empty buffer are written directly
+#define ROOMBA_TX_BUFFER_SIZE 128
+
 // You may be able to set this so you can use Roomba with NewSoftSerial
 // instead of HardwareSerial
 //#define HardwareSerial NewSoftSerial
@@ -380,7 +396,134 @@ public:
 	SensorRadius                   = 40,
 	SensorRightVelocity            = 41,
 	SensorLeftVelocity             = 42,
+	// Roomba 500/600 series only:
+	SensorLeftEncoderCounts        = 43,
+	SensorRightEncoderCounts       = 44,
+	SensorLightBumper              = 45,
+	SensorLightBumpLeftSignal      = 46,
+	SensorLightBumpFrontLeftSignal = 47,
+	SensorLightBumpCenterLeftSignal  = 48,
+	SensorLightBumpCenterRightSignal = 49,
+	SensorLightBumpFrontRightSignal  = 50,
+	SensorLightBumpRightSignal     = 51,
+	SensorIROpcodeLeft             = 52,
+	SensorIROpcodeRight            = 53,
+	SensorLeftMotorCurrent         = 54,
+	SensorRightMotorCurrent        = 55,
+	SensorMainBrushCurrent         = 56,
+	SensorSideBrushCurrent         = 57,
+	SensorStasis                   = 58,
     } Sensor;
+
+    /// \enum SensorFieldFlags
+    /// Flags in Roomba::SensorField
+    typedef enum
+    {
+	SensorFieldSigned = 0x1, ///< Data is a signed value
+	SensorFieldGroup  = 0x2, ///< Packet ID is a group of consecutive packet IDs
+    } SensorFieldFlags;
+
+    /// \struct SensorField
+    /// Describes how the data for a sensor packet ID is encoded, and where it is decoded to in
+    /// Roomba::SensorValues. See sensorField()
+    typedef struct
+    {
+	uint8_t size;  ///< Number of data bytes. For groups the total size of all members
+	uint8_t flags; ///< ORed Roomba::SensorFieldFlags
+	uint8_t field; ///< Offset of the field in SensorValues, or for groups the first member packet ID
+    } SensorField;
+
+    /// \struct SensorValues
+    /// Decoded sensor data, with one field for each single packet ID in Roomba::Sensor.
+    /// Field types match the size and signedness of the packet data.
+    /// See the Open Interface manual for units.
+    typedef struct
+    {
+	uint8_t  bumpsAndWheelDrops;          ///< Packet ID 7, ROOMBA_MASK_BUMP_* and ROOMBA_MASK_WHEELDROP_*
+	uint8_t  wall;                        ///< Packet ID 8
+	uint8_t  cliffLeft;                   ///< Packet ID 9
+	uint8_t  cliffFrontLeft;              ///< Packet ID 10
+	uint8_t  cliffFrontRight;             ///< Packet ID 11
+	uint8_t  cliffRight;                  ///< Packet ID 12
+	uint8_t  virtualWall;                 ///< Packet ID 13
+	uint8_t  overcurrents;                ///< Packet ID 14
+	uint8_t  irByte;                      ///< Packet ID 17
+	uint8_t  buttons;                     ///< Packet ID 18
+	int16_t  distance;                    ///< Packet ID 19, mm since last read
+	int16_t  angle;                       ///< Packet ID 20, degrees since last read
+	uint8_t  chargingState;               ///< Packet ID 21, one of Roomba::ChargeState
+	uint16_t voltage;                     ///< Packet ID 22, mV
+	int16_t  current;                     ///< Packet ID 23, mA
+	int8_t   temperature;                 ///< Packet ID 24, degrees C
+	/// Packet ID 25, mAh.
+	/// Supposedly unsigned according to the OI docs, but it has been seen to
+	/// underflow to ~65000mAh, so signed works better.
+	int16_t  charge;
+	uint16_t capacity;                    ///< Packet ID 26, mAh
+	uint16_t wallSignal;                  ///< Packet ID 27
+	uint16_t cliffLeftSignal;             ///< Packet ID 28
+	uint16_t cliffFrontLeftSignal;        ///< Packet ID 29
+	uint16_t cliffFrontRightSignal;       ///< Packet ID 30
+	uint16_t cliffRightSignal;            ///< Packet ID 31
+	uint8_t  userDigitalInputs;           ///< Packet ID 32
+	uint16_t userAnalogInput;             ///< Packet ID 33
+	uint8_t  chargingSources;             ///< Packet ID 34
+	uint8_t  oiMode;                      ///< Packet ID 35, one of Roomba::Mode
+	uint8_t  songNumber;                  ///< Packet ID 36
+	uint8_t  songPlaying;                 ///< Packet ID 37
+	uint8_t  numberOfStreamPackets;       ///< Packet ID 38
+	int16_t  velocity;                    ///< Packet ID 39, mm/s
+	int16_t  radius;                      ///< Packet ID 40, mm
+	int16_t  rightVelocity;               ///< Packet ID 41, mm/s
+	int16_t  leftVelocity;                ///< Packet ID 42, mm/s
+	uint16_t leftEncoderCounts;           ///< Packet ID 43
+	uint16_t rightEncoderCounts;          ///< Packet ID 44
+	uint8_t  lightBumper;                 ///< Packet ID 45
+	uint16_t lightBumpLeftSignal;         ///< Packet ID 46
+	uint16_t lightBumpFrontLeftSignal;    ///< Packet ID 47
+	uint16_t lightBumpCenterLeftSignal;   ///< Packet ID 48
+	uint16_t lightBumpCenterRightSignal;  ///< Packet ID 49
+	uint16_t lightBumpFrontRightSignal;   ///< Packet ID 50
+	uint16_t lightBumpRightSignal;        ///< Packet ID 51
+	uint8_t  irOpcodeLeft;                ///< Packet ID 52
+	uint8_t  irOpcodeRight;               ///< Packet ID 53
+	int16_t  leftMotorCurrent;            ///< Packet ID 54, mA
+	int16_t  rightMotorCurrent;           ///< Packet ID 55, mA
+	int16_t  mainBrushCurrent;            ///< Packet ID 56, mA
+	int16_t  sideBrushCurrent;            ///< Packet ID 57, mA
+	uint8_t  stasis;                      ///< Packet ID 58
+    } SensorValues;
+
+    /// \struct StreamStats
+    /// Counters kept by pollSensors(), see streamStats()
+    typedef struct
+    {
+	uint32_t frames;         ///< Frames decoded with a correct checksum
+	uint32_t checksumErrors; ///< Frames dropped because of a bad checksum
+	uint32_t frameErrors;    ///< Frames dropped because the size or a packet ID was not what was expected
+	uint32_t rxOverruns;     ///< Times the receive buffer filled up and bytes were lost
+	uint32_t bytes;          ///< Bytes read from the serial port while polling for frames
+	uint32_t rescans;        ///< Times a broken frame was looked through for the start of the next one
+	uint16_t rxHighWater;    ///< Most bytes ever found waiting in the receive buffer
+	uint16_t rxBufferSize;   ///< Size of the receive buffer, 0 if the serial port default is used
+    } StreamStats;
+
+    /// \enum RequestStatus
+    /// Status of an asynchronous request, returned by pollRequest()
+    typedef enum
+    {
+	RequestStatusIdle     = 0, ///< Unknown handle, or no request was made
+	RequestStatusPending  = 1, ///< Still waiting for the response
+	RequestStatusDone     = 2, ///< The whole response has been read
+	RequestStatusTimedOut = 3, ///< The response did not arrive before the deadline
+	RequestStatusError    = 4, ///< The response made no sense, eg a too long script
+    } RequestStatus;
+
+    /// Called when an asynchronous request completes, times out or fails
+    /// \param[in] handle The handle returned when the request was made
+    /// \param[in] status One of Roomba::RequestStatus
+    /// \param[in] len Number of response bytes read. For requestScript() the length of the script
+    typedef void (*RequestCallback)(uint8_t handle, RequestStatus status, uint8_t len);
   
     /// Constructor. You can have multiple simultaneous Roomba if that makes sense.
     /// \param[in] serial POinter to the HardwareSerial port to use to communicate with the Roomba. 
@@ -388,11 +531,42 @@ public:
     /// \param[in] baud the baud rate to use on the serial port. Defaults to 57600, the default for the Roomba.
     Roomba(HardwareSerial* serial = &Serial, Baud baud = Baud57600);
 
+    /// Constructor for any other kind of serial port, eg a SoftwareSerial when several
+    /// Roombas are driven from one board. start() and baud() cant restart such a port,
+    /// so the caller has to begin() it at the right baud rate, and setRxBufferSize() and the
+    /// overrun counter have no effect.
+    /// \param[in] stream Pointer to the serial port to use to communicate with the Roomba
+    /// \param[in] baud the baud rate the serial port runs at
+    Roomba(Stream* stream, Baud baud);
+
     /// Resets the Roomba. 
     /// It will emit its startup message
     /// Caution, this may take several seconds to complete
     void reset();
 
+    /// Starts a batch of commands. Until the matching commit(), commands are only staged,
+    /// and then go out in one write, eg a song definition and the command that plays it.
+    /// Batches can be nested, the bytes are written when the outermost batch is committed.
+    /// Queries such as getSensors() always write out everything staged so far.
+    /// If a batch outgrows ROOMBA_TX_BUFFER_SIZE, the staged commands are written early.
+    void beginBatch();
+
+    /// Ends the batch started by beginBatch(), and writes the staged commands if it was the outermost one
+    void commit();
+
+    /// Sends raw bytes to the Roomba, eg a command that has no method here.
+    /// They are staged and batched like any other command
+    /// \param[in] data The bytes to send
+    /// \param[in] len Number of bytes in data
+    void write(const uint8_t* data, uint8_t len);
+
+    /// Sets the size of the receive buffer which the UART interrupt fills, so bytes
+    /// from the Roomba are not lost while loop() is busy with something else.
+    /// Takes effect when the serial port is next started by start() or baud().
+    /// Only supported by the ESP8266 HardwareSerial, ignored elsewhere.
+    /// \param[in] size Size of the buffer in bytes. 0 keeps the serial port default
+    void setRxBufferSize(uint16_t size);
+
     /// Starts the Open Interface and sets the mode to Passive. 
     /// You must send this before sending any other commands.
     /// Initialises the serial port to the baud rate given in the constructor
@@ -407,6 +581,13 @@ public:
     /// Baud is on of the Roomba::Baud enums
     void baud(Baud baud);
 
+    /// Changes the baud rate of the serial port only, without telling the Roomba.
+    /// Use this to find the rate the Roomba is at, for example after a reset has put it back to its default.
+    /// Create only. No equivalent on Roomba.
+    /// \param[in] baud Baud code, one of Roomba::Baud
+    /// \return false if the serial port is not a HardwareSerial, so its rate is up to the caller
+    bool serialBaud(Baud baud);
+
     /// Sets the OI to Safe mode.
     /// In Safe mode, the cliff and wheel drop detectors work to prevent Roomba driving off a cliff
     void safeMode();
@@ -590,18 +771,44 @@ public:
     bool getSensorsList(uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len);
 
     /// Polls the serial input for data belonging to a sensor data stream previously requested with stream().
-    /// As sensor data is read it is appended to dest until at most len bytes are stored there. 
-    /// When a complete sensor stream has been read with a correct checksum, returns true. 
-    /// See the Open Interface manual for details on how the sensor data will be encoded in dest.
+    /// Sensor data is decoded a byte at a time as it arrives, into a shadow copy of the sensor values.
+    /// When a complete sensor stream has been read with a correct checksum, the shadow copy is
+    /// copied to dest and returns true. Frames with a bad checksum are discarded and dest is left untouched.
     /// Discards characters that are not part of a stream, such as the messages the Roomba 
-    /// sends at startup and while charging.
+    /// sends at startup and while charging. If the stream was requested with stream(), the
+    /// size and packet IDs of each frame are checked against the request, so that a data byte of 19
+    /// is not mistaken for the start of a frame. When a frame turns out to be broken, the bytes
+    /// received after its start are looked through again for the real start of a frame, so only
+    /// the broken frame is lost and not the one that follows it.
     /// Create only. No equivalent on Roomba.
-    /// \param[out] dest Destination where the read data is stored. Must have at least len bytes available.
-    /// \param[out] packetLen Lenth of the read packet
-    /// \param[in] len Max number of sensor data bytes to store to dest
-    /// \return true when a complete stream has been read, and the checksum is correct. The sensor data
-    /// (at most len bytes) will have been stored into dest, ready for the caller to decode.
-    bool pollSensors(uint8_t* dest, uint8_t destSize, uint8_t *packetLen);
+    /// \param[out] dest Destination where the decoded sensor values are stored. Fields for packet IDs
+    /// not in the stream keep whatever was decoded to them last.
+    /// \return true when a complete stream has been read, and the checksum is correct.
+    bool pollSensors(SensorValues* dest);
+
+    /// Returns the counters kept by pollSensors()
+    const StreamStats& streamStats() const { return _streamStats; }
+
+    /// Returns how the data for a sensor packet ID is encoded, and where it is decoded to
+    /// \param[in] packetID The sensor packet ID, one of Roomba::Sensor
+    /// \return Pointer to the SensorField for packetID, or NULL if the packet ID is not known
+    static const SensorField* sensorField(uint8_t packetID);
+
+    /// Returns the number of data bytes the Roomba sends for a list of sensor packet IDs, as in the
+    /// response to getSensorsList()
+    /// \param[in] packetIDs Array of IDs from Roomba::Sensor
+    /// \param[in] numPacketIDs number of IDs in the packetIDs array
+    /// \return The number of data bytes, or 0 if any of the IDs is not known
+    static uint8_t sensorsDataSize(const uint8_t* packetIDs, uint8_t numPacketIDs);
+
+    /// Decodes the response to getSensorsList() or requestSensorsList() into dest
+    /// \param[in] packetIDs Array of IDs from Roomba::Sensor that were requested
+    /// \param[in] numPacketIDs number of IDs in the packetIDs array
+    /// \param[in] data The response data
+    /// \param[in] len Number of bytes in data
+    /// \param[out] dest Where the decoded sensor values are stored
+    /// \return true if len is the size of the data for packetIDs and it was all decoded
+    static bool decodeSensors(const uint8_t* packetIDs, uint8_t numPacketIDs, const uint8_t* data, uint8_t len, SensorValues* dest);
 
     /// Reads a the contents of the script most recently specified by a call to script().
     /// Create only. No equivalent on Roomba.
@@ -611,6 +818,48 @@ public:
     /// \return The actual number of bytes in the script, even if this is more than len. By calling 
     /// getScript(NULL, 0), you can determine how many bytes would be required to store the script.
     uint8_t getScript(uint8_t* dest, uint8_t len);
+
+    /// Asynchronous version of getSensors(). Sends the query and returns straight away. The response
+    /// is read into dest by later calls to pollRequest() or pollSensors(), while the request is pending
+    /// pollSensors() does not decode the stream.
+    /// Only one request can be pending at a time.
+    /// \param[in] packetID The ID of the sensor packet to read from Roomba::Sensor
+    /// \param[out] dest Destination where the read data is stored. Must stay valid until the request completes
+    /// \param[in] len Number of sensor data bytes to read
+    /// \param[in] callback Optional function to call when the request completes or fails
+    /// \param[in] timeout Deadline in milliseconds for the whole response
+    /// \return A handle for pollRequest(), or 0 if another request is still pending
+    uint8_t requestSensors(uint8_t packetID, uint8_t* dest, uint8_t len, RequestCallback callback = NULL, uint16_t timeout = ROOMBA_READ_TIMEOUT);
+
+    /// Asynchronous version of getSensorsList(). See requestSensors().
+    /// Create only. No equivalent on Roomba.
+    /// \param[in] packetIDs Array of IDs from Roomba::Sensor of the sensor packets to read
+    /// \param[in] numPacketIDs number of IDs in the packetIDs array
+    /// \param[out] dest Destination where the read data is stored. Must stay valid until the request completes
+    /// \param[in] len Number of sensor data bytes to read
+    /// \param[in] callback Optional function to call when the request completes or fails
+    /// \param[in] timeout Deadline in milliseconds for the whole response
+    /// \return A handle for pollRequest(), or 0 if another request is still pending
+    uint8_t requestSensorsList(const uint8_t* packetIDs, uint8_t numPacketIDs, uint8_t* dest, uint8_t len, RequestCallback callback = NULL, uint16_t timeout = ROOMBA_READ_TIMEOUT);
+
+    /// Asynchronous version of getScript(). See requestSensors().
+    /// Create only. No equivalent on Roomba.
+    /// \param[out] dest Destination where the script is stored. Must stay valid until the request completes
+    /// \param[in] len The maximum number of bytes to place in dest
+    /// \param[in] callback Optional function to call when the request completes or fails. Gets the
+    /// actual length of the script, even if this is more than len
+    /// \param[in] timeout Deadline in milliseconds for the whole response
+    /// \return A handle for pollRequest(), or 0 if another request is still pending
+    uint8_t requestScript(uint8_t* dest, uint8_t len, RequestCallback callback = NULL, uint16_t timeout = ROOMBA_READ_TIMEOUT);
+
+    /// Reads whatever response bytes are available for the pending request, without blocking.
+    /// Call this from loop() until the request is no longer pending.
+    /// \param[in] handle The handle returned when the request was made
+    /// \return The status of the request, RequestStatusIdle if handle is not the most recent request
+    RequestStatus pollRequest(uint8_t handle);
+
+    /// Abandons the pending request, if any. Its callback is not called.
+    void cancelRequest();
   
 private:
     /// \enum PollState
@@ -619,21 +868,97 @@ private:
     {
 	PollStateIdle         = 0,
 	PollStateWaitCount    = 1,
-	PollStateWaitBytes    = 2,
-	PollStateWaitChecksum = 3,
+	PollStateWaitID       = 2,
+	PollStateWaitBytes    = 3,
+	PollStateWaitChecksum = 4,
     } PollState;
 
+    /// Starts tracking a request whose query has been sent
+    uint8_t startRequest(uint8_t* dest, uint8_t len, uint8_t expected, bool script, RequestCallback callback, uint16_t timeout);
+
+    /// Reads available bytes for the pending request and checks its deadline
+    void serviceRequest();
+
+    /// Finishes the pending request with status
+    void finishRequest(RequestStatus status);
+
+    /// Stages command cmd followed by data, and writes it out unless a batch is open
+    void send(const uint8_t* cmd, uint8_t len, const uint8_t* data = NULL, uint8_t dataLen = 0);
+
+    /// Stages a single byte command
+    void sendByte(uint8_t opcode);
+
+    /// Stages a query and writes it out along with everything staged before it
+    void sendQuery(const uint8_t* cmd, uint8_t len, const uint8_t* data = NULL, uint8_t dataLen = 0);
+
+    /// Writes out the staged commands
+    void flushTx();
+
+    /// Shared part of the constructors
+    void init(Stream* stream, Baud baud);
+
+    /// Starts the serial port at _baud with the configured receive buffer size
+    void beginSerial();
+
+    /// Updates the receive buffer stats, returns false if bytes have been lost since the last check
+    bool checkRx();
+
+    /// Starts decoding the data for packetID in the stream
+    bool pollStartPacket(uint8_t packetID);
+
+    /// Decodes the next byte of the stream, returns true when it completes a good frame
+    bool pollByte(uint8_t ch);
+
+    /// Drops the frame being decoded and replays its bytes from the next possible frame start
+    void pollRescan();
+
     /// The baud rate to use for the serial port
     uint32_t        _baud;
 	
     /// The serial port to use to talk to the Roomba
-    HardwareSerial* _serial;
+    Stream*         _serial;
+
+    /// The same port if it is a HardwareSerial which can be started and sized, else NULL
+    HardwareSerial* _hardwareSerial;
     
     /// Variables for keeping track of polling of data streams
     uint8_t         _pollState; /// Current state of polling, one of Roomba::PollState
     uint8_t         _pollSize;  /// Expected size of the data stream in bytes
     uint8_t         _pollCount; /// Num of bytes read so far
-    uint8_t         _pollChecksum; /// Running checksum counter of data bytes + count
+    uint8_t         _pollChecksum; /// Running checksum of all bytes in the frame
+    uint8_t         _pollIndex; /// Num of packet IDs read so far
+    uint8_t         _pollRemaining; /// Data bytes left for the current packet ID
+    uint8_t         _pollMember; /// Single packet ID the next data byte belongs to
+    uint8_t         _pollMemberCount; /// Data bytes of _pollMember read so far
+    uint16_t        _pollValue; /// Value of _pollMember decoded so far
+    SensorValues    _pollShadow; /// Values decoded from the current frame
+    uint8_t         _pollFrame[ROOMBA_FRAME_BUFFER_SIZE]; /// Bytes of the current frame, then the bytes to replay
+    uint8_t         _pollFrameLength; /// Bytes of the current frame, more than the buffer size if they did not fit
+    uint8_t         _pollReplayIndex; /// Next byte of _pollFrame to replay
+    uint8_t         _pollReplayLength; /// End of the bytes to replay
+    StreamStats     _streamStats;
+
+    /// Commands staged by send()
+    uint8_t         _txBuffer[ROOMBA_TX_BUFFER_SIZE];
+    uint8_t         _txLength; /// Number of bytes in _txBuffer
+    uint8_t         _txBatch; /// Depth of beginBatch() calls
+
+    /// The stream last requested with stream(), used to validate the frames
+    uint8_t         _streamIDs[ROOMBA_MAX_STREAM_IDS];
+    uint8_t         _streamIDCount; /// 0 if the stream is unknown
+    uint8_t         _streamSize; /// Expected size byte of each frame
+
+    /// Variables for keeping track of the asynchronous request
+    uint8_t         _requestHandle; /// Handle of the most recent request
+    uint8_t         _requestStatus; /// One of Roomba::RequestStatus
+    uint8_t*        _requestDest;
+    uint8_t         _requestLen; /// Max number of bytes to store to _requestDest
+    uint8_t         _requestExpected; /// Num of bytes in the response, 0 until a script length is known
+    uint8_t         _requestCount; /// Num of bytes read so far
+    bool            _requestScript; /// Waiting for the length byte that starts a script response
+    uint16_t        _requestTimeout;
+    unsigned long   _requestStart;
+    RequestCallback _requestCallback;
 
 };
 
@@ -0,0 +1,131 @@
+// StreamBench.pde
+//
+// Benchmark for the Roomba stream decoder
+// Replays sensor stream frames from memory through pollSensors(), so no Roomba is needed.
+// Reports how many frames per second are decoded from a clean stream, and how many bytes
+// are dropped after a corrupted byte before the next good frame. At best that is just
+// the broken frame itself.
+// The decoder does not allocate memory, so the free heap should be the same before and after.
+//
+// Runs on any Arduino, prints the results to Serial
+
+#include <Roomba.h>
+
+// The packets asked for in stream(), and a frame of them as the Roomba would send it
+uint8_t packetids[] = { 7, 21, 22, 25, 26 };
+uint8_t frame[] = { 19, 13, 7, 0, 21, 2, 22, 0x3b, 0x9c, 25, 0x0a, 0x8c, 26, 0x0a, 0xf0, 0 };
+
+// Replays frame over and over, a few bytes per call to available() like a real serial port.
+// Whatever the Roomba class writes is thrown away.
+class ReplayStream : public Stream
+{
+public:
+    ReplayStream() : _offset(0), _chunk(0), _corrupt(-1), _bytesRead(0) {}
+    // The next time byte number offset of the frame comes round, xor it with 0xff
+    void corrupt(int offset) { _corrupt = offset; }
+    unsigned long bytesRead() { return _bytesRead; }
+    int available()
+    {
+	if (_chunk == 0)
+	    _chunk = 8;
+	return _chunk;
+    }
+    int read()
+    {
+	uint8_t ch = frame[_offset];
+	if (_offset == _corrupt)
+	{
+	    ch ^= 0xff;
+	    _corrupt = -1;
+	}
+	_offset = (_offset + 1) % sizeof(frame);
+	_bytesRead++;
+	if (_chunk)
+	    _chunk--;
+	return ch;
+    }
+    int peek() { return frame[_offset]; }
+    size_t write(uint8_t) { return 1; }
+    void flush() {}
+    using Print::write;
+
+private:
+    uint8_t _offset;
+    uint8_t _chunk;
+    int     _corrupt;
+    unsigned long _bytesRead;
+};
+
+ReplayStream replay;
+Roomba roomba(&replay, Roomba::Baud115200);
+Roomba::SensorValues values;
+
+void setup()
+{
+    Serial.begin(115200);
+
+    // Fill in the checksum, so all the bytes of the frame add up to 0
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < sizeof(frame) - 1; i++)
+	sum += frame[i];
+    frame[sizeof(frame) - 1] = -sum;
+
+    roomba.stream(packetids, sizeof(packetids));
+}
+
+// Polls until the next good frame, returns the number of bytes read to get there
+unsigned long nextFrame()
+{
+    unsigned long start = replay.bytesRead();
+    while (!roomba.pollSensors(&values))
+	;
+    return replay.bytesRead() - start;
+}
+
+void loop()
+{
+#ifdef ESP8266
+    uint32_t heap = ESP.getFreeHeap();
+#endif
+    nextFrame(); // Line up with the start of a frame
+
+    const unsigned long frames = 10000;
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < frames; i++)
+	nextFrame();
+    unsigned long elapsed = micros() - start;
+    Serial.print("Frames/s: ");
+    Serial.println(frames * 1000000.0 / elapsed);
+    if (values.voltage != 0x3b9c || values.charge != 0x0a8c)
+	Serial.println("Error: decoded values are wrong");
+
+    // Break each byte of the frame in turn and see how long it takes to get back in step
+    unsigned long worst = 0;
+    unsigned long total = 0;
+    for (uint8_t offset = 0; offset < sizeof(frame); offset++)
+    {
+	replay.corrupt(offset);
+	unsigned long bytes = nextFrame() - sizeof(frame);
+	worst = max(worst, bytes);
+	total += bytes;
+    }
+    Serial.print("Bytes dropped, average: ");
+    Serial.print(total / sizeof(frame));
+    Serial.print(" worst: ");
+    Serial.println(worst);
+
+    const Roomba::StreamStats& stats = roomba.streamStats();
+    Serial.print("Frames: ");
+    Serial.print(stats.frames);
+    Serial.print(" checksum errors: ");
+    Serial.print(stats.checksumErrors);
+    Serial.print(" frame errors: ");
+    Serial.print(stats.frameErrors);
+    Serial.print(" rescans: ");
+    Serial.println(stats.rescans);
+#ifdef ESP8266
+    Serial.print("Heap change: ");
+    Serial.println((int32_t)(ESP.getFreeHeap() - heap));
+#endif
+    delay(10000);
+}
@@ -1,22 +1,163 @@
 #include "secrets.h"
 
+// The MQTT server and login, BRC_PIN, ROOMBA_MODEL, the STATUS_* reporting, stream,
+// poll, stats and history intervals are only defaults. They can be changed at runtime
+// on the settings/set topic, see the README.
+
 #define HOSTNAME "roomba" // e.g. roomba.local
 #define BRC_PIN 14
+
+// Gateway mode, one ESP serving several Roombas over a single MQTT connection.
+// The first Roomba is always on Serial and BRC_PIN, each other one needs a
+// SoftwareSerial RX and TX pin and its own BRC pin, listed as {rx, tx, brc}.
+// They get their own entity IDs and topics, suffixed with their number.
+//#define GATEWAY_ROBOTS {{4, 5, 12}, {13, 15, 16}}
+#define GATEWAY_BAUD Roomba::Baud115200
 #define ROOMBA_650_SLEEP_FIX 1
 
 #define SET_DATETIME 1
 #define NTP_SERVER_1 "pool.ntp.org"
 #define NTP_SERVER_2 "time.nist.gov"
 
+// Startup. The sensor stream starts first, then WiFi, MQTT and NTP (retried every
+// NTP_TIMEOUT ms).
+#define WIFI_CONNECT_TIMEOUT 15000 // ms
+#define NTP_TIMEOUT 10000 // ms
+
+// Reconnects back off exponentially, with jitter. WiFi gets WIFI_CONNECT_TIMEOUT ms to
+// associate, doubling up to WIFI_BACKOFF_MAX. Failed MQTT connects are retried after
+// MQTT_BACKOFF_MIN ms, doubling up to MQTT_BACKOFF_MAX. Each MQTT connect blocks for up
+// to MQTT_CONNECT_TIMEOUT ms to look up the server, and as long again to connect.
+#define WIFI_BACKOFF_MAX 300000 // ms
+#define MQTT_BACKOFF_MIN 1000 // ms
+#define MQTT_BACKOFF_MAX 120000 // ms
+#define MQTT_CONNECT_TIMEOUT 2000 // ms
+
 #define ADC_VOLTAGE_DIVIDER 44.551316985
 //#define ENABLE_ADC_SLEEP
 
+// A0 is read once every ADC_SAMPLE_INTERVAL ms and smoothed by ADC_FILTER (0 to 1,
+// higher follows faster). The boot check averages ADC_BOOT_SAMPLES readings. With
+// ENABLE_ADC_SLEEP it also stands in for the first Roomba's voltage when its stream
+// has gone quiet.
+#define ADC_SAMPLE_INTERVAL 200 // ms
+#define ADC_FILTER 0.1
+#define ADC_BOOT_SAMPLES 10
+
+// Battery model, see Battery in main.cpp. The state of charge follows the Roomba's
+// charge reading with a time constant of BATTERY_CHARGE_TAU, and the resting voltage
+// with BATTERY_VOLTAGE_TAU. The time to empty or full uses the current averaged over
+// BATTERY_CURRENT_TAU. The battery is reported low below BATTERY_LOW_LEVEL, or when
+// it will be empty within BATTERY_LOW_TIME.
+#define BATTERY_CAPACITY 2200 // mAh, until the Roomba reports its own
+#define BATTERY_CHARGE_TAU 60000 // ms
+#define BATTERY_VOLTAGE_TAU 600000 // ms
+#define BATTERY_CURRENT_TAU 30000 // ms
+#define BATTERY_REST_CURRENT 100 // mA, less than this either way counts as resting
+#define BATTERY_LOW_LEVEL 15 // %
+#define BATTERY_LOW_TIME 10 // minutes
+
+// State reporting. Changes to cleaning/docked/charging are published right away,
+// changes in current, voltage or charge by more than these deltas are published
+// at most every STATUS_MIN_INTERVAL ms. Otherwise the state is only sent as a heartbeat.
+#define STATUS_HEARTBEAT_INTERVAL 60000 // ms
+#define STATUS_MIN_INTERVAL 1000 // ms
+#define STATUS_CURRENT_DELTA 100 // mA
+#define STATUS_VOLTAGE_DELTA 200 // mV
+#define STATUS_CHARGE_DELTA 20 // mAh
+
+// Adaptive sensor rate. When the Roomba hasn't been cleaning for STREAM_IDLE_TIMEOUT ms
+// the sensor stream is paused and the sensors are polled every SENSOR_POLL_INTERVAL ms instead.
+#define ADAPTIVE_STREAM
+#define STREAM_IDLE_TIMEOUT 60000 // ms
+#define SENSOR_POLL_INTERVAL 2000 // ms
+// The stream is requested again once the state is this old, or 3 poll intervals if that's longer
+#define STATE_STALE_TIMEOUT 30000 // ms
+
+// Duty cycling, needs GPIO16 wired to RST. Once every Roomba has been docked and idle
+// for DUTY_CYCLE_IDLE_TIMEOUT ms, the ESP deep sleeps DUTY_CYCLE_SLEEP ms at a time. It
+// wakes to poll the sensors and publish what changed, or the state every
+// DUTY_CYCLE_HEARTBEAT ms, and goes back to sleep. Commands only get through while awake.
+//#define DUTY_CYCLE
+#define DUTY_CYCLE_IDLE_TIMEOUT 300000 // ms
+#define DUTY_CYCLE_SLEEP 300000 // ms
+#define DUTY_CYCLE_WAKE_EARLY 5000 // ms before a scheduled job, the sleep timer drifts
+#define DUTY_CYCLE_AWAKE_TIMEOUT 20000 // ms, sleep again even if nothing could be published
+#define DUTY_CYCLE_HEARTBEAT 1800000 // ms
+#define DUTY_CYCLE_NTP_WAKEUPS 12 // Wakeups between NTP syncs, which correct the sleep timer's drift
+#define DUTY_CYCLE_NTP_TIMEOUT 3000 // ms a wakeup waits for NTP before it sleeps anyway
+
+// Size of the buffer the UART interrupt fills with bytes from the Roomba. The
+// default of 256 holds only a few frames of the sensor stream at 115200 baud,
+// and bytes are lost when loop() stalls on WiFi. stats shows the high-water mark.
+#define ROOMBA_RX_BUFFER_SIZE 1024
+
+// Auto-baud. When a streaming Roomba sends no good frame for LINK_CHECK_FAILURES
+// checks LINK_CHECK_INTERVAL ms apart, the serial port moves on to the next of the
+// usual OI baud rates and asks for the stream again, until frames come through.
+// A reset puts the Roomba back at 115200, or 19200 if BRC was held low.
+#define LINK_CHECK_INTERVAL 1000 // ms
+#define LINK_CHECK_FAILURES 2
+
+// Outgoing MQTT messages are queued in MQTT_QUEUE_SLOTS slots of MQTT_MAX_PACKET_SIZE
+// bytes each, and at most MQTT_QUEUE_DRAIN of them are published per loop
+#define MQTT_QUEUE_SLOTS 8
+#define MQTT_QUEUE_DRAIN 2
+
+// Telnet logging. DLOG and VLOG format into a LOG_BUFFER_SIZE ring in RAM, lines
+// of up to LOG_LINE_SIZE bytes, and loop() sends it on to the telnet client in
+// LOG_DRAIN_CHUNK byte writes for at most LOG_DRAIN_BUDGET us per loop. Lines that
+// find the ring full are dropped and counted in the stats.
+#define LOG_BUFFER_SIZE 2048
+#define LOG_LINE_SIZE 160
+#define LOG_DRAIN_CHUNK 128
+#define LOG_DRAIN_BUDGET 2000 // us
+
+// How often loop timing and stream stats are published on the stats, stats/stream
+// and stats/loop topics
+#define STATS_INTERVAL 60000 // ms
+
+// Also publish the state in a fixed binary layout, see BinaryState in main.cpp,
+// on the state/bin topic. The JSON state is always published for Home Assistant.
+//#define MQTT_BINARY_STATE
+
+// Sensor history. Every HISTORY_INTERVAL ms (0 for every stream frame) the state is
+// delta encoded into a ring of HISTORY_BLOCKS 256 byte blocks per Roomba. When the
+// ring is full the oldest block is dropped, or with HISTORY_SPILL appended to flash,
+// up to HISTORY_SPILL_SIZE bytes per Roomba. The history command publishes the
+// blocks on the history topic, one per message.
+#define HISTORY_INTERVAL 1000 // ms
+#define HISTORY_BLOCKS 16
+//#define HISTORY_SPILL
+#define HISTORY_SPILL_SIZE 65536 // bytes
+
+// Cleaning sessions. While a Roomba cleans, its wheel encoders are integrated into a
+// pose, and the cells of a SESSION_GRID_SIZE square grid of SESSION_GRID_CELL mm cells
+// it drives over add up to the area covered. A session ends when the Roomba docks, or
+// has not been cleaning for SESSION_END_TIMEOUT ms. One summary is then published on
+// the session topic.
+#define SESSION_GRID_CELL 250 // mm
+#define SESSION_GRID_SIZE 64 // cells
+#define SESSION_END_TIMEOUT 60000 // ms
+
+// Bump, wheel drop, cliff, virtual wall and wheel overcurrent events are published on
+// the event topic as soon as a sensor bit has changed for EVENT_DEBOUNCE_FRAMES stream
+// frames in a row, and each one at most every EVENT_MIN_INTERVAL ms.
+#define EVENT_DEBOUNCE_FRAMES 2
+#define EVENT_MIN_INTERVAL 1000 // ms
+
+// Local schedule. Each Roomba keeps up to SCHEDULE_ENTRIES jobs in flash that run an
+// MQTT command at a local time on given days, whether or not the network is up. See
+// the README for the format of the schedule/set topic.
+#define SCHEDULE_ENTRIES 8
+
 // define your Roomba model, e.g. "780"
 #define ROOMBA_MODEL "Roomba 780"
 
 // Only change if you know what you're doing!
 #define MQTT_PORT 1883
 #define MQTT_DISCOVERY "homeassistant"
+#define MQTT_DISCOVERY_STATUS_TOPIC "status" // Home Assistant's birth message
 #define MQTT_DEVICE_CLASS "vacuum"
 #define MQTT_DIVIDER "/"
 #define MQTT_TOPIC_BASE MQTT_DISCOVERY MQTT_DIVIDER MQTT_DEVICE_CLASS MQTT_DIVIDER
@@ -24,3 +165,15 @@
 #define MQTT_COMMAND_TOPIC "command"
 #define MQTT_STATE_TOPIC "state"
 #define MQTT_CONFIG_TOPIC "config"
+#define MQTT_STATS_TOPIC "stats"
+#define MQTT_STATS_STREAM_TOPIC MQTT_STATS_TOPIC "/stream"
+#define MQTT_STATS_LOOP_TOPIC MQTT_STATS_TOPIC "/loop"
+#define MQTT_HISTORY_TOPIC "history"
+#define MQTT_SESSION_TOPIC "session"
+#define MQTT_EVENT_TOPIC "event"
+#define MQTT_SCHEDULE_TOPIC "schedule"
+#define MQTT_SCHEDULE_SET_TOPIC MQTT_SCHEDULE_TOPIC "/set"
+#define MQTT_SETTINGS_TOPIC "settings"
+#define MQTT_SETTINGS_SET_TOPIC MQTT_SETTINGS_TOPIC "/set"
+#define MQTT_SENSOR_TOPIC "sensor" // Followed by the entity, e.g. sensor/voltage
+#define MQTT_BINARY_STATE_TOPIC MQTT_STATE_TOPIC "/bin"
@@ -7,57 +7,179 @@
 #include <ArduinoJson.h>
 #include <Timezone.h>
 #include "config.h"
+#include <LittleFS.h>
+#include <sys/time.h>
+#include <coredecls.h>
 extern "C" {
 #include "user_interface.h"
 }
 
 // Remote debugging over telnet. Just run:
 // `telnet roomba.local` OR `nc roomba.local 23`
+// Lines are formatted into a ring in RAM and drained to the client by
+// drainLog(), so a burst of logging costs a vsnprintf per line rather than
+// a wait on the socket, and the loop timing stays the same with it on.
 #if LOGGING
 #include <RemoteDebug.h>
-#define DLOG(msg, ...) if(Debug.isActive(Debug.DEBUG)){Debug.printf(msg, ##__VA_ARGS__);}
-#define VLOG(msg, ...) if(Debug.isActive(Debug.VERBOSE)){Debug.printf(msg, ##__VA_ARGS__);}
+#define DLOG(msg, ...) if(Debug.isActive(Debug.DEBUG)){logPrintf(msg, ##__VA_ARGS__);}
+#define VLOG(msg, ...) if(Debug.isActive(Debug.VERBOSE)){logPrintf(msg, ##__VA_ARGS__);}
+#define VLOG_HEX(label, data, length) if(Debug.isActive(Debug.VERBOSE)){logHex(label, data, length);}
 RemoteDebug Debug;
+
+typedef struct {
+  char data[LOG_BUFFER_SIZE];
+  uint16_t head; // Next byte to send
+  uint16_t length; // Bytes waiting to be sent
+  uint32_t drops; // Lines that found the ring full
+} LogRing;
+
+LogRing logRing;
+
+// Whole lines or nothing, so a full ring never leaves half a line behind
+void logWrite(const char *text, size_t length) {
+  if (length > (size_t)(LOG_BUFFER_SIZE - logRing.length)) {
+    logRing.drops++;
+    return;
+  }
+  size_t tail = (logRing.head + logRing.length) % LOG_BUFFER_SIZE;
+  size_t first = min(length, LOG_BUFFER_SIZE - tail);
+  memcpy(logRing.data + tail, text, first);
+  memcpy(logRing.data, text + first, length - first);
+  logRing.length += length;
+}
+
+void logPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void logPrintf(const char *format, ...) {
+  char line[LOG_LINE_SIZE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t)length >= sizeof(line)) {
+    // Cut short, but still ends the line
+    length = sizeof(line) - 1;
+    line[length - 1] = '\n';
+  }
+  logWrite(line, length);
+}
+
+// Logs data as one line of hex bytes after label
+void logHex(const char *label, const uint8_t *data, size_t length) {
+  static const char digits[] = "0123456789abcdef";
+  char line[LOG_LINE_SIZE];
+  size_t used = min((size_t)max(snprintf(line, sizeof(line), "%s:", label), 0), sizeof(line) - 1);
+  for (size_t i = 0; i < length && used + 4 <= sizeof(line); i++) {
+    line[used++] = ' ';
+    line[used++] = digits[data[i] >> 4];
+    line[used++] = digits[data[i] & 0xf];
+  }
+  line[used++] = '\n';
+  logWrite(line, used);
+}
+
+// Sends what's in the ring to the telnet client, until it's empty or budget us are up
+void drainLog(uint32_t budget) {
+  uint32_t start = micros();
+  while (logRing.length && micros() - start < budget) {
+    size_t chunk = min((size_t)logRing.length, min((size_t)LOG_DRAIN_CHUNK, (size_t)(LOG_BUFFER_SIZE - logRing.head)));
+    Debug.write((const uint8_t *)logRing.data + logRing.head, chunk);
+    logRing.head = (logRing.head + chunk) % LOG_BUFFER_SIZE;
+    logRing.length -= chunk;
+  }
+}
+
+// Before a restart or a deep sleep, so the last lines aren't lost
+void flushLog() {
+  drainLog(UINT32_MAX);
+}
 #else
 #define DLOG(msg, ...)
+#define VLOG(msg, ...)
+#define VLOG_HEX(label, data, length)
+void drainLog(uint32_t) {}
+void flushLog() {}
 #endif
 
-// Roomba setup
-Roomba roomba(&Serial, Roomba::Baud115200);
+// Gateway mode drives the GATEWAY_ROBOTS Roombas over SoftwareSerial ports as
+// well as the one on Serial
+#ifdef GATEWAY_ROBOTS
+#include <SoftwareSerial.h>
 
-// Roomba state
 typedef struct {
-  // Sensor values
-  int16_t distance;
-  uint8_t chargingState;
-  uint16_t voltage;
-  int16_t current;
-  // Supposedly unsigned according to the OI docs, but I've seen it
-  // underflow to ~65000mAh, so I think signed will work better.
-  int16_t charge;
-  uint16_t capacity;
+  int8_t rxPin;
+  int8_t txPin;
+  uint8_t brcPin;
+} GatewayRobot;
+
+const GatewayRobot gatewayRobots[] = GATEWAY_ROBOTS;
+#define ROBOT_COUNT (1 + sizeof(gatewayRobots) / sizeof(gatewayRobots[0]))
+#else
+#define ROBOT_COUNT 1
+#endif
 
+// Roomba state
+struct RoombaState : public Roomba::SensorValues {
   // Derived state
   bool cleaning;
   bool docked;
+  bool batteryLow; // Set by updateBattery()
 
   int timestamp;
   bool sent;
-} RoombaState;
-
-RoombaState roombaState = {};
+};
 
-// Roomba sensor packet
-uint8_t roombaPacket[100];
-uint8_t sensors[] = {
+// Roomba sensor stream, unless the settings have another
+const uint8_t defaultSensors[] = {
+  Roomba::Sensors7to16, // PIDs 7 to 16, 10 bytes, bumps, wheel drops, cliffs, virtual wall and overcurrents
   Roomba::SensorDistance, // PID 19, 2 bytes, mm, signed
+  Roomba::SensorAngle, // PID 20, 2 bytes, degrees, signed
   Roomba::SensorChargingState, // PID 21, 1 byte
   Roomba::SensorVoltage, // PID 22, 2 bytes, mV, unsigned
   Roomba::SensorCurrent, // PID 23, 2 bytes, mA, signed
   Roomba::SensorBatteryCharge, // PID 25, 2 bytes, mAh, unsigned
-  Roomba::SensorBatteryCapacity // PID 26, 2 bytes, mAh, unsigned
+  Roomba::SensorBatteryCapacity, // PID 26, 2 bytes, mAh, unsigned
+  Roomba::SensorLeftEncoderCounts, // PID 43, 2 bytes, unsigned, wraps around
+  Roomba::SensorRightEncoderCounts // PID 44, 2 bytes, unsigned, wraps around
 };
 
+// Runtime settings. config.h and secrets.h only give the defaults. Settings
+// sent to the settings/set topic are kept in flash as a versioned blob, which
+// is read once at boot, and everything else reads the struct directly.
+#define SETTINGS_VERSION 1
+#define SETTINGS_SENSORS_MAX 16
+#define SETTINGS_INTERVAL_MAX 86400000 // ms, longest interval or timeout accepted
+
+typedef struct {
+  uint8_t version; // SETTINGS_VERSION, older layouts are ignored
+  uint16_t size; // sizeof(Settings)
+  // These only take effect after a restart
+  char mqttServer[64];
+  uint16_t mqttPort;
+  char mqttUser[32];
+  char mqttPassword[64];
+  uint8_t brcPin;
+  // These take effect straight away
+  char model[32];
+  uint8_t sensorCount;
+  uint8_t sensors[SETTINGS_SENSORS_MAX];
+  uint32_t heartbeatInterval; // ms
+  uint32_t statusMinInterval; // ms
+  uint16_t currentDelta; // mA
+  uint16_t voltageDelta; // mV
+  uint16_t chargeDelta; // mAh
+  uint32_t streamIdleTimeout; // ms
+  uint32_t sensorPollInterval; // ms
+  uint32_t statsInterval; // ms
+  uint32_t historyInterval; // ms
+  uint32_t checksum; // Must stay last
+} Settings;
+
+Settings settings;
+
 // Central European Time (Frankfurt, Paris)
 TimeChangeRule CEST = {"CEST", Last, Sun, Mar, 2, 120};     // Central European Summer Time
 TimeChangeRule CET = {"CET ", Last, Sun, Oct, 3, 60};       // Central European Standard Time
@@ -69,216 +191,2191 @@ bool OTAStarted;
 
 // MQTT setup
 PubSubClient mqttClient(wifiClient);
-const char *commandTopic = MQTT_COMMAND_TOPIC;
-const char *stateTopic = MQTT_STATE_TOPIC;
-const char *configTopic = MQTT_CONFIG_TOPIC;
-
-void wakeup() {
-  DLOG("Wakeup Roomba\n");
-  pinMode(BRC_PIN,OUTPUT);
-  digitalWrite(BRC_PIN,LOW);
-  delay(200);
-  pinMode(BRC_PIN,INPUT);
-  delay(200);
-  Serial.write(128); // Start
-}
-
-void wakeOnDock() {
-  DLOG("Wakeup Roomba on dock\n");
-  wakeup();
+
+// State of the WiFi or MQTT connection, kept by updateConnections()
+typedef struct {
+  bool up;
+  bool wasUp; // Has been up since boot, so the next connect is a reconnect
+  unsigned long attemptTime; // When the last attempt to connect started
+  unsigned long retryDelay; // How long after attemptTime to try again
+  unsigned long backoff; // retryDelay before the jitter, 0 after a success
+  unsigned long downTime; // When the link went down
+  uint32_t reconnects;
+  uint32_t downTotal; // ms spent down, not counting the current outage
+} Link;
+
+Link wifiLink = {};
+Link mqttLink = {};
+
+// Connections are retried with exponential backoff, jittered so a fleet
+// doesn't hammer the access point or broker in step after an outage
+void linkUp(Link &link) {
+  link.up = true;
+  link.downTotal += millis() - link.downTime;
+  if (link.wasUp) {
+    link.reconnects++;
+  }
+  link.wasUp = true;
+  link.backoff = 0;
+}
+
+// The first retry after losing a link is straight away
+void linkDown(Link &link) {
+  link.up = false;
+  link.downTime = millis();
+  link.attemptTime = link.downTime;
+  link.retryDelay = 0;
+}
+
+// Schedules the next attempt after a failed one, doubling the delay from
+// minDelay up to maxDelay and adding up to 25% of jitter
+void backOff(Link &link, unsigned long minDelay, unsigned long maxDelay) {
+  link.attemptTime = millis();
+  link.backoff = link.backoff ? min(link.backoff * 2, maxDelay) : minDelay;
+  link.retryDelay = link.backoff + random(link.backoff / 4 + 1);
+}
+
+bool retryDue(const Link &link) {
+  return millis() - link.attemptTime >= link.retryDelay;
+}
+
+// A full MQTT topic, with its length and hash so incoming topics can be
+// matched without comparing whole strings
+typedef struct {
+  char name[100];
+  uint16_t length;
+  uint32_t hash;
+} MQTTTopic;
+
+// IDs and topics of the ESP itself, built once by setupTopics()
+char macAddress[13];
+MQTTTopic statsTopic;
+MQTTTopic statsStreamTopic;
+MQTTTopic statsLoopTopic;
+MQTTTopic settingsTopic;
+MQTTTopic settingsSetTopic;
+MQTTTopic discoveryStatusTopic;
+
+// Commands that need the Roomba to settle between bytes are queued as timed
+// steps instead of blocking in delay(). loop() runs whatever steps are due, so
+// OTA, MQTT and the sensor stream keep being serviced while a command plays out.
+#define COMMAND_QUEUE_SIZE 24
+#define COMMAND_STEP_BYTES 4
+
+typedef enum {
+  CommandStepWrite      = 0, // Write the step bytes to the Roomba
+  CommandStepBRCLow     = 1, // Pull the BRC pin low
+  CommandStepBRCRelease = 2, // Put the BRC pin back to high-impedence
+  CommandStepSong       = 3, // Upload song data[0] of the songs catalog
+  CommandStepStream     = 4, // Reset the stream and request the one of settings.sensors
+} CommandStepType;
+
+typedef struct {
+  uint16_t delay; // ms to wait after the previous step ran
+  uint8_t type;
+  uint8_t length;
+  uint8_t data[COMMAND_STEP_BYTES];
+} CommandStep;
+
+// Songs are kept in flash, and only uploaded to a Roomba the first time they're
+// played. Song i goes in song slot i, the 500 and 600 series only have slots 0
+// to 4. Notes are note and duration pairs, the durations in 1/64s.
+typedef struct {
+  const uint8_t *notes; // PROGMEM
+  uint8_t length; // Bytes, 2 per note
+} CatalogSong;
+
+const uint8_t locateSong0[] PROGMEM = {55, 32, 55, 32, 55, 32, 51, 24, 58, 8, 55, 32, 51, 24, 58, 8, 55, 64};
+const uint8_t locateSong1[] PROGMEM = {62, 32, 62, 32, 62, 32, 63, 24, 58, 8, 54, 32, 51, 24, 58, 8, 55, 64};
+const uint8_t locateSong2[] PROGMEM = {67, 32, 55, 24, 55, 8, 67, 32, 66, 24, 65, 8, 64, 8, 63, 8, 64, 16, 30, 16, 56, 16, 61, 32};
+const uint8_t locateSong3[] PROGMEM = {60, 24, 59, 8, 58, 8, 57, 8, 58, 16, 10, 16, 52, 16, 54, 32, 51, 24, 58, 8, 55, 32, 51, 24, 58, 8, 55, 64};
+
+const CatalogSong songs[] = {
+  {locateSong0, sizeof(locateSong0)},
+  {locateSong1, sizeof(locateSong1)},
+  {locateSong2, sizeof(locateSong2)},
+  {locateSong3, sizeof(locateSong3)},
+};
+#define SONG_COUNT (sizeof(songs) / sizeof(songs[0]))
+#define SONG_MAX_BYTES 32 // 16 notes
+
+static_assert(SONG_COUNT <= 5, "the Roomba only has song slots 0 to 4");
+
+// While the Roomba isn't cleaning there's no point decoding a frame every
+// 15ms, so after STREAM_IDLE_TIMEOUT the stream is paused and the sensors
+// are polled every SENSOR_POLL_INTERVAL. Streaming resumes when a poll shows
+// it cleaning or a command wakes it up.
+typedef enum {
+  SensorModeStream = 0,
+  SensorModePoll   = 1,
+} SensorMode;
+
+// Sensor history, recorded into a ring of fixed size blocks so a whole block
+// can be dropped (or spilled to flash) when the ring is full. Each block starts
+// with a keyframe of absolute values, the samples after it are deltas:
+//   keyframe: voltage u16, current i16, charge u16, capacity u16, status u8
+//   delta:    ms since the previous sample, then voltage, current and charge
+//             changes as zigzag varints, then status u8
+// status is the charging state in the low nibble, cleaning in bit 4 and
+// docked in bit 5. Blocks are published as they are, little endian, up to
+// the end of the used data.
+#define HISTORY_VERSION 1
+#define HISTORY_BLOCK_SIZE 256
+#define HISTORY_HEADER_SIZE 9
+#define HISTORY_SAMPLE_MAX 16 // Longest encoding of a sample
+
+typedef struct {
+  uint8_t version;   // HISTORY_VERSION
+  uint8_t count;     // Number of samples in the block
+  uint16_t sequence; // Counts up with every block, gaps are lost blocks
+  uint32_t time;     // millis() of the keyframe
+  uint8_t length;    // Bytes of data used
+  uint8_t data[HISTORY_BLOCK_SIZE - HISTORY_HEADER_SIZE];
+} HistoryBlock;
+
+static_assert(sizeof(HistoryBlock) == HISTORY_BLOCK_SIZE, "history blocks must not be padded");
+
+typedef struct {
+  HistoryBlock blocks[HISTORY_BLOCKS];
+  uint8_t head;  // Oldest block
+  uint8_t count; // Blocks in use, the newest one is still being filled
+  uint16_t nextSequence;
+  RoombaState last; // Values of the last sample, the deltas are against these
+  unsigned long lastTime;
+  bool flushing; // Publishing one block per loop()
+  uint8_t flushIndex; // Next block to publish, counted from head
+  uint32_t flushFileOffset; // Next spilled block to publish
+} History;
+
+// A cleaning session, integrated from every sensor frame while it lasts.
+// The pose starts at 0, 0 facing along x.
+typedef struct {
+  bool active;
+  unsigned long startTime;
+  unsigned long lastCleaningTime; // The last frame that was still cleaning
+  unsigned long lastTime; // The last frame integrated
+  time_t startEpoch; // 0 if NTP hadn't set the time yet
+  uint16_t leftCounts; // Encoder counts of the last frame
+  uint16_t rightCounts;
+  float x; // mm
+  float y; // mm
+  float heading; // radians
+  int32_t distance; // mm, from the distance packet
+  uint32_t turned; // degrees, either way, from the angle packet
+  int16_t startCharge; // mAh
+  float energy; // mWh drawn from the battery
+  uint16_t cellsCovered;
+  uint8_t grid[SESSION_GRID_SIZE * SESSION_GRID_SIZE / 8]; // One bit per cell
+} Session;
+
+// A job of the local schedule. The command is one of the MQTT commands.
+#define SCHEDULE_COMMAND_SIZE 16
+
+typedef struct {
+  uint8_t days; // Bit 0 is Sunday
+  uint8_t hour; // Local time
+  uint8_t minute;
+  char command[SCHEDULE_COMMAND_SIZE];
+} ScheduleEntry;
+
+typedef struct {
+  ScheduleEntry entries[SCHEDULE_ENTRIES];
+  uint8_t count;
+  time_t nextFire; // When the next job is due, 0 if none or the time isn't known
+  time_t lastRun; // When jobs last ran, so a clock correction doesn't run them twice
+} Schedule;
+
+// Safety events, one bit per entry of eventSources
+#define EVENT_SOURCES 12
+
+typedef struct {
+  uint16_t levels; // Debounced state of each source
+  uint16_t reported; // Sources whose activation was published, so their release is too
+  uint8_t frames[EVENT_SOURCES]; // Frames in a row the source has read differently from levels
+  unsigned long lastTime[EVENT_SOURCES]; // When the source was last published as active
+} Events;
+
+// Battery model. Each frame moves the state of charge by the charge counted
+// from the current, then pulls it towards the Roomba's own charge reading and,
+// while the battery rests, towards what its voltage says. The pulls are first
+// order filters over the time since the last frame, so they behave the same
+// whether the sensors are streamed or polled.
+typedef struct {
+  bool valid; // Set by the first frame
+  float soc; // State of charge, 0 to 1
+  float current; // mA, filtered, negative while discharging
+  uint16_t capacity; // mAh
+  unsigned long lastTime; // When soc was last updated
+} Battery;
+
+// Sensor entities, one bit per entry of sensorEntities
+#define SENSOR_ENTITIES 15
+
+// Home Assistant discovery config. It never changes at runtime unless the
+// settings do, so it's serialized once and the cached payload is published
+// whenever its hash differs from the one last sent. Home Assistant coming
+// back online zeroes sentHash to have it sent again.
+typedef struct {
+  char payload[MQTT_MAX_PACKET_SIZE];
+  uint16_t length;
+  uint32_t hash; // FNV-1a of payload
+  uint32_t sentHash; // hash of the payload last published, 0 if none
+  bool failed; // Too long to publish, so it never is
+} DiscoveryConfig;
+
+// Everything kept per Roomba. There's one per robot, and loop() scans them all.
+struct Robot {
+  Roomba roomba;
+  uint8_t index;
+  uint8_t brcPin;
+
+  RoombaState state;
+  RoombaState lastSentState; // The state as it was last published
+  long lastStateMsgTime;
+
+  // IDs and topics, built once by setupTopics()
+  char entityID[30];
+  char deviceName[30];
+  char baseTopic[100];
+  MQTTTopic commandTopic;
+  MQTTTopic stateTopic;
+  MQTTTopic configTopic;
+  MQTTTopic historyTopic;
+  MQTTTopic sessionTopic;
+  MQTTTopic eventTopic;
+  MQTTTopic scheduleTopic;
+  MQTTTopic scheduleSetTopic;
+  MQTTTopic binaryStateTopic;
+
+  CommandStep commandQueue[COMMAND_QUEUE_SIZE];
+  uint8_t commandQueueHead;
+  uint8_t commandQueueCount;
+  unsigned long commandQueueLastRun;
+
+  uint8_t songSlots; // Bit per song known to be uploaded to the Roomba
+
+  uint8_t sensorMode; // One of SensorMode
+  unsigned long lastCleaningTime;
+  unsigned long lastSensorPollTime;
+  uint8_t sensorPollHandle; // Pending sensor poll, 0 if none
+  uint8_t sensorPollData[64];
+
+  // Auto-baud, see checkLink()
+  uint32_t linkFrames; // Good frames as of the last check
+  unsigned long linkCheckTime;
+  uint8_t linkFailures; // Checks in a row without a good frame
+  uint8_t baudIndex; // Rate the serial port is at, index into probeBauds
+  uint16_t baudProbes;
+
+  History history;
+  Session session;
+  Events events;
+  Schedule schedule;
+  Battery battery;
+  DiscoveryConfig config;
+
+  // Sensor entities, see sensorEntities
+  MQTTTopic entityTopics[SENSOR_ENTITIES];
+  int32_t entityValues[SENSOR_ENTITIES]; // As last published
+  uint32_t entitiesSent; // Entities whose value has been published
+  uint32_t entityConfigsDue; // Entities whose config still has to go out
+  char entityConfigTopic[100]; // Of the entity config in the publish queue
+  unsigned long lastEntityTime;
+};
+
+Robot robots[ROBOT_COUNT];
+
+bool queueStep(Robot &robot, uint16_t delay, uint8_t type, const uint8_t *data = NULL, uint8_t length = 0) {
+  if (robot.commandQueueCount >= COMMAND_QUEUE_SIZE || length > COMMAND_STEP_BYTES) {
+    DLOG("Command queue full, dropping step\n");
+    return false;
+  }
+  if (robot.commandQueueCount == 0) {
+    // Delays are relative to the previous step, so an idle queue counts from now
+    robot.commandQueueLastRun = millis();
+  }
+  CommandStep *step = &robot.commandQueue[(robot.commandQueueHead + robot.commandQueueCount) % COMMAND_QUEUE_SIZE];
+  step->delay = delay;
+  step->type = type;
+  step->length = length;
+  if (length) {
+    memcpy(step->data, data, length);
+  }
+  robot.commandQueueCount++;
+  return true;
+}
+
+bool queueWrite(Robot &robot, uint16_t delay, uint8_t opcode) {
+  return queueStep(robot, delay, CommandStepWrite, &opcode, 1);
+}
+
+bool queueWrite(Robot &robot, uint16_t delay, uint8_t opcode, uint8_t arg) {
+  uint8_t data[] = {opcode, arg};
+  return queueStep(robot, delay, CommandStepWrite, data, sizeof(data));
+}
+
+// Steps that are due together go out in one write, e.g. a song and the command
+// that plays it
+void runCommandQueue(Robot &robot) {
+  robot.roomba.beginBatch();
+  while (robot.commandQueueCount > 0) {
+    CommandStep *step = &robot.commandQueue[robot.commandQueueHead];
+    unsigned long now = millis();
+    if (now - robot.commandQueueLastRun < step->delay) {
+      break;
+    }
+    switch (step->type) {
+      case CommandStepWrite:
+        robot.roomba.write(step->data, step->length);
+        break;
+      case CommandStepBRCLow:
+        // The bytes staged before the pulse have to go out before it
+        robot.roomba.commit();
+        robot.roomba.beginBatch();
+        pinMode(robot.brcPin,OUTPUT);
+        digitalWrite(robot.brcPin,LOW);
+        break;
+      case CommandStepBRCRelease:
+        robot.roomba.commit();
+        robot.roomba.beginBatch();
+        pinMode(robot.brcPin,INPUT);
+        break;
+      case CommandStepSong: {
+        // The notes have to be in RAM to be sent
+        const CatalogSong &song = songs[step->data[0]];
+        uint8_t notes[SONG_MAX_BYTES];
+        memcpy_P(notes, song.notes, song.length);
+        robot.roomba.song(step->data[0], notes, song.length);
+        robot.songSlots |= 1 << step->data[0];
+        break;
+      }
+      case CommandStepStream:
+        // Reset stream sensor values
+        robot.roomba.stream({}, 0);
+        // Through stream(), so the decoder knows what the frames look like
+        robot.roomba.stream(settings.sensors, settings.sensorCount);
+        break;
+    }
+    robot.commandQueueLastRun = now;
+    robot.commandQueueHead = (robot.commandQueueHead + 1) % COMMAND_QUEUE_SIZE;
+    robot.commandQueueCount--;
+  }
+  robot.roomba.commit();
+}
+
+// Queues song to play after delay, uploading it first if the Roomba may not have it.
+// Returns how long it plays for in ms.
+uint16_t queueSong(Robot &robot, uint16_t delay, uint8_t song) {
+  if (!(robot.songSlots & (1 << song))) {
+    queueStep(robot, delay, CommandStepSong, &song, 1);
+    delay = 0;
+  }
+  queueWrite(robot, delay, 141, song); // Play
+  uint16_t ticks = 0;
+  for (uint8_t i = 1; i < songs[song].length; i += 2) {
+    ticks += pgm_read_byte(&songs[song].notes[i]);
+  }
+  return ticks * 1000 / 64;
+}
+
+void wakeup(Robot &robot) {
+  DLOG("Wakeup Roomba %d\n", robot.index);
+  queueStep(robot, 0, CommandStepBRCLow);
+  queueStep(robot, 200, CommandStepBRCRelease);
+  queueWrite(robot, 200, 128); // Start
+}
+
+void wakeOnDock(Robot &robot) {
+  DLOG("Wakeup Roomba %d on dock\n", robot.index);
+  wakeup(robot);
 #ifdef ROOMBA_650_SLEEP_FIX
   // Some black magic from @AndiTheBest to keep the Roomba awake on the dock
   // See https://github.com/johnboiles/esp-roomba-mqtt/issues/3#issuecomment-402096638
-  delay(10);
-  Serial.write(135); // Clean
-  delay(150);
-  Serial.write(143); // Dock
+  queueWrite(robot, 10, 135); // Clean
+  queueWrite(robot, 150, 143); // Dock
 #endif
 }
 
-void wakeOffDock() {
-  DLOG("Wakeup Roomba off Dock\n");
-  Serial.write(131); // Safe mode
-  delay(300);
-  Serial.write(130); // Passive mode
-}
-
-bool performCommand(const char *cmdchar) {
-  wakeup();
-
-  // Char* string comparisons dont always work
-  String cmd(cmdchar);
-
-  // MQTT protocol commands
-  if (cmd == "turn_on") {
-    DLOG("Turning on\n");
-    roomba.cover();
-    roombaState.cleaning = true;
-  } else if (cmd == "turn_off") {
-    DLOG("Turning off\n");
-    roomba.power();
-    roombaState.cleaning = false;
-  } else if (cmd == "start" || cmd == "pause") {
-    DLOG("Toggling\n");
-    roomba.cover();
-  } else if (cmd == "stop") {
-    if (roombaState.cleaning) {
-      DLOG("Stopping\n");
-      roomba.cover();
-    } else {
-      DLOG("Not cleaning, can't stop\n");
-    }
-  } else if (cmd == "clean_spot") {
-    DLOG("Cleaning Spot\n");
-    roombaState.cleaning = true;
-    roomba.spot();
-  } else if (cmd == "locate") {
-    DLOG("Playing song #0\n");
-    roomba.safeMode();
-    delay(50);
-    roomba.playSong(0);
-    delay(4000);
-    roomba.playSong(1);
-    delay(4000);
-    roomba.playSong(2);
-    delay(3500);
-    roomba.playSong(3);
-  } else if (cmd == "return_to_base") {
-    DLOG("Returning to Base\n");
-    roombaState.cleaning = true;
-    roomba.dock();
+void wakeOffDock(Robot &robot) {
+  DLOG("Wakeup Roomba %d off Dock\n", robot.index);
+  queueWrite(robot, 0, 131); // Safe mode
+  queueWrite(robot, 300, 130); // Passive mode
+}
+
+// Derives cleaning/docked from freshly read sensor values
+void updateRoombaState(RoombaState &state) {
+  state.timestamp = millis();
+  state.sent = false;
+  state.cleaning = false;
+  state.docked = false;
+  if (state.current < -400) {
+    state.cleaning = true;
+  } else if (state.current > -50) {
+    state.docked = true;
+  }
+}
+
+void setSensorMode(Robot &robot, uint8_t mode) {
+  if (mode == robot.sensorMode) {
+    return;
+  }
+  robot.sensorMode = mode;
+  if (mode == SensorModeStream) {
+    DLOG("Resume streaming\n");
+    queueWrite(robot, 0, 150, Roomba::StreamCommandResume);
+    robot.lastCleaningTime = millis();
   } else {
-    return false;
+    DLOG("Roomba %d idle, polling sensors instead of streaming\n", robot.index);
+    queueWrite(robot, 0, 150, Roomba::StreamCommandPause);
+    robot.lastSensorPollTime = millis();
   }
-  return true;
 }
 
-char* getMAC(const char* divider = "") {
+// How old the state can get before the stream is asked for again. Polls only
+// refresh it every sensorPollInterval, which may be longer than the timeout.
+unsigned long stateStaleTimeout() {
+  return max((unsigned long)STATE_STALE_TIMEOUT, 3 * (unsigned long)settings.sensorPollInterval);
+}
+
+// Asks for the stream from scratch, e.g. after the Roomba fell asleep
+void requestStream(Robot &robot) {
+  robot.roomba.stream(settings.sensors, settings.sensorCount);
+  robot.sensorMode = SensorModeStream;
+  robot.lastCleaningTime = millis();
+}
+
+// The rates checkLink() goes through, starting with the one setupRobots() uses
+const Roomba::Baud probeBauds[] = {
+  Roomba::Baud115200, Roomba::Baud19200, Roomba::Baud57600, Roomba::Baud38400,
+};
+
+// Finds the Roomba's baud rate again when the stream stops decoding, e.g.
+// after a reset or a flat battery put it back to its default rate
+void checkLink(Robot &robot) {
+  unsigned long now = millis();
+  if (now - robot.linkCheckTime < LINK_CHECK_INTERVAL) {
+    return;
+  }
+  robot.linkCheckTime = now;
+  uint32_t frames = robot.roomba.streamStats().frames;
+  bool good = frames != robot.linkFrames;
+  robot.linkFrames = frames;
+  if (good || robot.sensorMode != SensorModeStream || robot.commandQueueCount) {
+    // Polls check themselves, and a command in flight may be waking it up
+    robot.linkFailures = 0;
+    return;
+  }
+  if (++robot.linkFailures < LINK_CHECK_FAILURES) {
+    return;
+  }
+  robot.linkFailures = 0;
+  uint8_t next = (robot.baudIndex + 1) % (sizeof(probeBauds) / sizeof(probeBauds[0]));
+  if (!robot.roomba.serialBaud(probeBauds[next])) {
+    return; // SoftwareSerial, the gateway rate is fixed
+  }
+  robot.baudIndex = next;
+  robot.baudProbes++;
+  DLOG("No frames from Roomba %d, trying %u baud\n", robot.index, robot.roomba.baudCodeToBaudRate(probeBauds[next]));
+  robot.roomba.start();
+  requestStream(robot);
+}
+
+void recordHistory(Robot &robot);
+void updateSession(Robot &robot);
+void updateEvents(Robot &robot);
+void updateBattery(Robot &robot);
+
+// Decodes a finished sensor poll
+void checkSensorPoll(Robot &robot) {
+  Roomba::RequestStatus status = robot.roomba.pollRequest(robot.sensorPollHandle);
+  if (status == Roomba::RequestStatusPending) {
+    return;
+  }
+  robot.sensorPollHandle = 0;
+  RoombaState &state = robot.state;
+  uint8_t size = Roomba::sensorsDataSize(settings.sensors, settings.sensorCount);
+  if (status == Roomba::RequestStatusDone
+      && Roomba::decodeSensors(settings.sensors, settings.sensorCount, robot.sensorPollData, size, &state)) {
+    VLOG("Polled sensors! Voltage:%dmV Current:%dmA Charge:%dmAh\n", state.voltage, state.current, state.charge);
+    updateRoombaState(state);
+    updateBattery(robot);
+    updateEvents(robot);
+    recordHistory(robot);
+    updateSession(robot);
+  } else {
+    VLOG("Sensor poll failed (status %d)\n", status);
+    VLOG_HEX("Poll data", robot.sensorPollData, Roomba::sensorsDataSize(settings.sensors, settings.sensorCount));
+  }
+}
+
+void updateSensorMode(Robot &robot) {
+#ifdef ADAPTIVE_STREAM
+  unsigned long now = millis();
+  if (robot.sensorPollHandle) {
+    checkSensorPoll(robot);
+  }
+  if (robot.sensorMode == SensorModeStream) {
+    if (robot.state.cleaning) {
+      robot.lastCleaningTime = now;
+    } else if (now - robot.lastCleaningTime > settings.streamIdleTimeout) {
+      setSensorMode(robot, SensorModePoll);
+    }
+  } else if (robot.state.cleaning) {
+    setSensorMode(robot, SensorModeStream);
+  } else if (now - robot.lastSensorPollTime > settings.sensorPollInterval && robot.commandQueueCount == 0) {
+    // Don't query in the middle of a command, the Roomba may be asleep
+    robot.lastSensorPollTime = now;
+    uint8_t size = Roomba::sensorsDataSize(settings.sensors, settings.sensorCount);
+    if (size > 0 && size <= sizeof(robot.sensorPollData)) {
+      robot.sensorPollHandle = robot.roomba.requestSensorsList(settings.sensors, settings.sensorCount, robot.sensorPollData, size);
+    }
+  }
+#endif
+}
+
+// FNV-1a hash of a topic, also returns its length
+uint32_t hashTopic(const char *topic, uint16_t *length) {
+  uint32_t hash = 2166136261u;
+  const char *c = topic;
+  for (; *c; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  *length = c - topic;
+  return hash;
+}
+
+void setMQTTTopic(MQTTTopic *topic, const char *base, const char *suffix) {
+  snprintf(topic->name, sizeof(topic->name), "%s%s%s", base, MQTT_DIVIDER, suffix);
+  topic->hash = hashTopic(topic->name, &topic->length);
+}
+
+bool topicMatches(const MQTTTopic &topic, const char *name, uint16_t length, uint32_t hash) {
+  return topic.length == length && topic.hash == hash && memcmp(topic.name, name, length) == 0;
+}
+
+void setupTopics() {
   byte MAC[6];
   WiFi.macAddress(MAC);
-  static char MACc[30];
-  sprintf(MACc, "%02X%s%02X%s%02X%s%02X%s%02X%s%02X", MAC[0], divider, MAC[1], divider, MAC[2], divider, MAC[3], divider, MAC[4], divider, MAC[5]);
-  return strlwr(MACc);
+  // avoid confusions with lower/upper case differences in IDs
+  snprintf(macAddress, sizeof(macAddress), "%02x%02x%02x%02x%02x%02x", MAC[0], MAC[1], MAC[2], MAC[3], MAC[4], MAC[5]);
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    // The first Roomba keeps the IDs it had before gateway mode
+    if (i == 0) {
+      snprintf(robot.entityID, sizeof(robot.entityID), "%s%s", MQTT_IDPREFIX, macAddress);
+      snprintf(robot.deviceName, sizeof(robot.deviceName), "Roomba %s", macAddress);
+    } else {
+      snprintf(robot.entityID, sizeof(robot.entityID), "%s%s_%d", MQTT_IDPREFIX, macAddress, i);
+      snprintf(robot.deviceName, sizeof(robot.deviceName), "Roomba %s %d", macAddress, i);
+    }
+    strlwr(robot.entityID);
+    snprintf(robot.baseTopic, sizeof(robot.baseTopic), "%s%s", MQTT_TOPIC_BASE, robot.entityID);
+    setMQTTTopic(&robot.commandTopic, robot.baseTopic, MQTT_COMMAND_TOPIC);
+    setMQTTTopic(&robot.stateTopic, robot.baseTopic, MQTT_STATE_TOPIC);
+    setMQTTTopic(&robot.configTopic, robot.baseTopic, MQTT_CONFIG_TOPIC);
+    setMQTTTopic(&robot.historyTopic, robot.baseTopic, MQTT_HISTORY_TOPIC);
+    setMQTTTopic(&robot.sessionTopic, robot.baseTopic, MQTT_SESSION_TOPIC);
+    setMQTTTopic(&robot.eventTopic, robot.baseTopic, MQTT_EVENT_TOPIC);
+    setMQTTTopic(&robot.scheduleTopic, robot.baseTopic, MQTT_SCHEDULE_TOPIC);
+    setMQTTTopic(&robot.scheduleSetTopic, robot.baseTopic, MQTT_SCHEDULE_SET_TOPIC);
+    setMQTTTopic(&robot.binaryStateTopic, robot.baseTopic, MQTT_BINARY_STATE_TOPIC);
+  }
+  // Stats are about the ESP, so they go with the first Roomba
+  setMQTTTopic(&statsTopic, robots[0].baseTopic, MQTT_STATS_TOPIC);
+  setMQTTTopic(&statsStreamTopic, robots[0].baseTopic, MQTT_STATS_STREAM_TOPIC);
+  setMQTTTopic(&statsLoopTopic, robots[0].baseTopic, MQTT_STATS_LOOP_TOPIC);
+  // So are the settings
+  setMQTTTopic(&settingsTopic, robots[0].baseTopic, MQTT_SETTINGS_TOPIC);
+  setMQTTTopic(&settingsSetTopic, robots[0].baseTopic, MQTT_SETTINGS_SET_TOPIC);
+  setMQTTTopic(&discoveryStatusTopic, MQTT_DISCOVERY, MQTT_DISCOVERY_STATUS_TOPIC);
 }
 
-char* getEntityID() {
-  char entityID[100];
-  sprintf(entityID, "%s%s", MQTT_IDPREFIX, getMAC());
-  // avoid confusions with lower/upper case differences in IDs
-  return strlwr(entityID);
+// Loop instrumentation. Each stage of loop() is timed in CPU cycles, and the
+// min/avg/max of every stage plus a histogram of whole loop times are
+// published on the stats topic every STATS_INTERVAL, then start over.
+typedef enum {
+  LoopStageOTA      = 0,
+  LoopStageDebug    = 1,
+  LoopStageTimers   = 2, // Reconnects, wakeups and state reports
+  LoopStageCommands = 3,
+  LoopStageSensors  = 4,
+  LoopStageMQTT     = 5,
+  LoopStageLoop     = 6, // The whole loop
+  LoopStageCount
+} LoopStage;
+
+const char *loopStageNames[LoopStageCount] = {"ota", "debug", "timers", "commands", "sensors", "mqtt", "loop"};
+
+typedef struct {
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t count;
+} StageTiming;
+
+// Upper bounds of the loop time histogram buckets in us, the last bucket is everything slower
+#define LATENCY_BUCKETS 8
+const uint32_t latencyBucketLimits[LATENCY_BUCKETS - 1] = {100, 500, 1000, 5000, 10000, 50000, 100000};
+
+typedef struct {
+  StageTiming stages[LoopStageCount];
+  uint32_t latencyHistogram[LATENCY_BUCKETS];
+  uint32_t publishes;
+  uint32_t reconnects;
+} LoopStats;
+
+LoopStats loopStats;
+unsigned long lastStatsTime = 0;
+unsigned long firstStateTime = 0; // ms from boot to the first published state, 0 until then
+
+void resetLoopStats() {
+  for (int i = 0; i < LoopStageCount; i++) {
+    loopStats.stages[i].min = UINT32_MAX;
+    loopStats.stages[i].max = 0;
+    loopStats.stages[i].total = 0;
+    loopStats.stages[i].count = 0;
+  }
+  memset(loopStats.latencyHistogram, 0, sizeof(loopStats.latencyHistogram));
+}
+
+// Records the cycles since start against stage, returns the cycle count now
+// so stages can be chained
+uint32_t recordLoopStage(uint8_t stage, uint32_t start) {
+  uint32_t now = ESP.getCycleCount();
+  uint32_t cycles = now - start;
+  StageTiming *timing = &loopStats.stages[stage];
+  if (cycles < timing->min) {
+    timing->min = cycles;
+  }
+  if (cycles > timing->max) {
+    timing->max = cycles;
+  }
+  timing->total += cycles;
+  timing->count++;
+  return now;
+}
+
+void recordLoopLatency(uint32_t cycles) {
+  uint32_t us = cycles / ESP.getCpuFreqMHz();
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && us >= latencyBucketLimits[bucket]) {
+    bucket++;
+  }
+  loopStats.latencyHistogram[bucket]++;
+}
+
+// Converts a stage's timings to min/avg/max in us
+void stageMicros(const StageTiming &timing, uint32_t *min, uint32_t *avg, uint32_t *max) {
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  *min = timing.count ? timing.min / mhz : 0;
+  *avg = timing.count ? (timing.total / timing.count) / mhz : 0;
+  *max = timing.max / mhz;
+}
+
+// Serialized JSON payloads go here instead of into Strings on the heap
+char mqttPayload[MQTT_MAX_PACKET_SIZE];
+
+// Outgoing messages wait in a fixed set of slots until PubSubClient takes
+// them, so nothing is lost while the broker is away. A message of a type that
+// coalesces replaces the queued one for the same topic, since only the latest
+// state is worth sending. The queue drains MQTT_QUEUE_DRAIN messages per loop()
+// so a reconnect doesn't burst the whole backlog into the TCP stack.
+typedef enum {
+  MessageState   = 0,
+  MessageConfig  = 1,
+  MessageStats   = 2,
+  MessageHistory = 3,
+  MessageSession = 4,
+  MessageSchedule = 5,
+  MessageSettings = 6,
+  MessageEvent = 7,
+  MessageEntity = 8,
+  MessageTypeCount
+} MessageType;
+
+typedef struct {
+  bool retained;
+  bool coalesce; // Replace a queued message for the same topic
+} MessagePolicy;
+
+const MessagePolicy messagePolicies[MessageTypeCount] = {
+  {true, true},   // MessageState, so a restarted subscriber gets it straight away
+  {true, true},   // MessageConfig
+  {false, true},  // MessageStats
+  {false, false}, // MessageHistory, every block counts
+  {true, false},  // MessageSession, every session counts
+  {true, true},   // MessageSchedule
+  {true, true},   // MessageSettings
+  {false, false}, // MessageEvent, every edge counts
+  {true, true},   // MessageEntity, the sensor values, retained like the state
+};
+
+typedef struct {
+  const char *topic; // NULL if the slot is free. Must outlive the message
+  uint32_t sequence; // Messages go out in sequence order
+  uint8_t type; // One of MessageType
+  uint16_t length;
+  uint8_t payload[MQTT_MAX_PACKET_SIZE];
+} QueuedMessage;
+
+QueuedMessage publishQueue[MQTT_QUEUE_SLOTS];
+uint32_t publishSequence = 0;
+uint32_t publishDrops = 0; // Messages that found the queue full
+
+// Queues a message, returns false if it was dropped
+// PubSubClient counts the header, the topic length and the topic
+// against MQTT_MAX_PACKET_SIZE, and refuses anything that doesn't fit
+#define MQTT_PUBLISH_OVERHEAD (7 + 2)
+
+// Whether PubSubClient can send length bytes to topic in one packet
+bool fitsPacket(const char *topic, size_t length) {
+  return length <= sizeof(publishQueue[0].payload)
+    && MQTT_PUBLISH_OVERHEAD + strlen(topic) + length <= MQTT_MAX_PACKET_SIZE;
+}
+
+bool publishPayload(const char *topic, const uint8_t *payload, size_t length, uint8_t type) {
+  if (!fitsPacket(topic, length)) {
+    DLOG("Message for %s too long\n", topic);
+    publishDrops++;
+    return false;
+  }
+  QueuedMessage *slot = NULL;
+  for (uint8_t i = 0; i < MQTT_QUEUE_SLOTS; i++) {
+    QueuedMessage *message = &publishQueue[i];
+    if (messagePolicies[type].coalesce && message->topic == topic) {
+      slot = message; // Superseded, the replacement keeps its place in the queue
+      break;
+    }
+    if (!slot && !message->topic) {
+      slot = message;
+    }
+  }
+  if (!slot) {
+    publishDrops++;
+    return false;
+  }
+  if (slot->topic != topic) {
+    slot->topic = topic;
+    slot->sequence = publishSequence++;
+  }
+  slot->type = type;
+  slot->length = length;
+  if (length) {
+    memcpy(slot->payload, payload, length); // payload may be NULL, to clear a retained topic
+  }
+  return true;
+}
+
+bool publishJson(const char *topic, JsonDocument &root, uint8_t type) {
+  size_t length = serializeJson(root, mqttPayload, sizeof(mqttPayload));
+  if (length >= sizeof(mqttPayload) - 1) {
+    // Filled the buffer, so it was cut short and isn't valid JSON
+    DLOG("Message for %s too long\n", topic);
+    publishDrops++;
+    return false;
+  }
+  return publishPayload(topic, (const uint8_t *)mqttPayload, length, type);
+}
+
+// Whether a message for topic is still waiting in the queue
+bool publishPending(const char *topic) {
+  for (uint8_t i = 0; i < MQTT_QUEUE_SLOTS; i++) {
+    if (publishQueue[i].topic == topic) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t publishQueueCount() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MQTT_QUEUE_SLOTS; i++) {
+    if (publishQueue[i].topic) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Hands up to max of the oldest messages to PubSubClient. If the connection
+// dropped the message is retried after the reconnect, but one PubSubClient
+// refuses while connected is dropped, or it would hold up the queue for good.
+void drainPublishQueue(uint8_t max) {
+  while (max-- > 0 && mqttClient.connected()) {
+    QueuedMessage *oldest = NULL;
+    for (uint8_t i = 0; i < MQTT_QUEUE_SLOTS; i++) {
+      QueuedMessage *message = &publishQueue[i];
+      // Subtracting keeps the order right when the sequence wraps around
+      if (message->topic && (!oldest || (int32_t)(message->sequence - oldest->sequence) < 0)) {
+        oldest = message;
+      }
+    }
+    if (!oldest) {
+      return;
+    }
+    if (!mqttClient.publish(oldest->topic, oldest->payload, oldest->length, messagePolicies[oldest->type].retained)) {
+      if (!mqttClient.connected()) {
+        return;
+      }
+      DLOG("Publish to %s refused, dropping it\n", oldest->topic);
+      publishDrops++;
+      oldest->topic = NULL;
+      continue;
+    }
+    loopStats.publishes++;
+    if (oldest->type == MessageState && !firstStateTime) {
+      firstStateTime = millis();
+      DLOG("First state published %lums after boot\n", firstStateTime);
+    }
+    oldest->topic = NULL;
+  }
+}
+
+// Sends everything queued, before the ESP goes to sleep
+void flushPublishQueue() {
+  drainPublishQueue(MQTT_QUEUE_SLOTS);
+  mqttClient.loop();
+}
+
+uint8_t putVarint(uint8_t *p, uint32_t value) {
+  uint8_t length = 0;
+  while (value >= 0x80) {
+    p[length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[length++] = value;
+  return length;
+}
+
+uint8_t putZigzag(uint8_t *p, int32_t value) {
+  return putVarint(p, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+uint8_t historyStatus(const RoombaState &state) {
+  return (state.chargingState & 0x0f) | (state.cleaning << 4) | (state.docked << 5);
+}
+
+#ifdef HISTORY_SPILL
+void historyFileName(const Robot &robot, char *name, size_t size) {
+  snprintf(name, size, "/history%d.bin", robot.index);
+}
+
+// Appends a block that is about to be dropped to the history file, starting
+// the file over once it reaches HISTORY_SPILL_SIZE
+void spillHistoryBlock(const Robot &robot, const HistoryBlock &block) {
+  char name[20];
+  historyFileName(robot, name, sizeof(name));
+  File file = LittleFS.open(name, "a");
+  if (!file) {
+    return;
+  }
+  if (file.size() + sizeof(block) > HISTORY_SPILL_SIZE) {
+    file.close();
+    file = LittleFS.open(name, "w");
+  }
+  file.write((const uint8_t *)&block, sizeof(block));
+  file.close();
+}
+#endif
+
+HistoryBlock *newHistoryBlock(Robot &robot, unsigned long now) {
+  History &history = robot.history;
+  if (history.count == HISTORY_BLOCKS) {
+#ifdef HISTORY_SPILL
+    spillHistoryBlock(robot, history.blocks[history.head]);
+#endif
+    history.head = (history.head + 1) % HISTORY_BLOCKS;
+    history.count--;
+    if (history.flushIndex > 0) {
+      history.flushIndex--;
+    }
+  }
+  HistoryBlock *block = &history.blocks[(history.head + history.count) % HISTORY_BLOCKS];
+  history.count++;
+  block->version = HISTORY_VERSION;
+  block->count = 0;
+  block->sequence = history.nextSequence++;
+  block->time = now;
+  block->length = 0;
+  return block;
+}
+
+// Adds the current state to the history, at most every HISTORY_INTERVAL
+void recordHistory(Robot &robot) {
+  History &history = robot.history;
+  const RoombaState &state = robot.state;
+  unsigned long now = millis();
+  if (history.count && now - history.lastTime < settings.historyInterval) {
+    return;
+  }
+  uint8_t sample[HISTORY_SAMPLE_MAX];
+  uint8_t length = 0;
+  HistoryBlock *block = NULL;
+  if (history.count) {
+    block = &history.blocks[(history.head + history.count - 1) % HISTORY_BLOCKS];
+    length += putVarint(sample + length, now - history.lastTime);
+    length += putZigzag(sample + length, state.voltage - history.last.voltage);
+    length += putZigzag(sample + length, state.current - history.last.current);
+    length += putZigzag(sample + length, state.charge - history.last.charge);
+    sample[length++] = historyStatus(state);
+  }
+  if (!block || block->length + length > sizeof(block->data) || block->count == UINT8_MAX) {
+    block = newHistoryBlock(robot, now);
+    length = 0;
+    memcpy(sample + length, &state.voltage, sizeof(state.voltage));
+    length += sizeof(state.voltage);
+    memcpy(sample + length, &state.current, sizeof(state.current));
+    length += sizeof(state.current);
+    memcpy(sample + length, &state.charge, sizeof(state.charge));
+    length += sizeof(state.charge);
+    memcpy(sample + length, &state.capacity, sizeof(state.capacity));
+    length += sizeof(state.capacity);
+    sample[length++] = historyStatus(state);
+  }
+  memcpy(block->data + block->length, sample, length);
+  block->length += length;
+  block->count++;
+  history.last = state;
+  history.lastTime = now;
+}
+
+// Publishes the next block of a flush, spilled ones first. Once every block
+// has gone out only the newest one, which is still being filled, is kept.
+void flushHistory(Robot &robot) {
+  History &history = robot.history;
+  if (!history.flushing || !mqttClient.connected()) {
+    return;
+  }
+#ifdef HISTORY_SPILL
+  char name[20];
+  historyFileName(robot, name, sizeof(name));
+  File file = LittleFS.open(name, "r");
+  if (file) {
+    HistoryBlock block;
+    bool read = file.seek(history.flushFileOffset) && file.read((uint8_t *)&block, sizeof(block)) == sizeof(block);
+    file.close();
+    if (read) {
+      if (publishPayload(robot.historyTopic.name, (const uint8_t *)&block, HISTORY_HEADER_SIZE + block.length, MessageHistory)) {
+        history.flushFileOffset += sizeof(block);
+      }
+      return;
+    }
+    LittleFS.remove(name);
+    history.flushFileOffset = 0;
+  }
+#endif
+  if (history.flushIndex < history.count) {
+    const HistoryBlock &block = history.blocks[(history.head + history.flushIndex) % HISTORY_BLOCKS];
+    if (publishPayload(robot.historyTopic.name, (const uint8_t *)&block, HISTORY_HEADER_SIZE + block.length, MessageHistory)) {
+      history.flushIndex++;
+    }
+    return;
+  }
+  DLOG("Roomba %d history flushed\n", robot.index);
+  if (history.count > 1) {
+    history.head = (history.head + history.count - 1) % HISTORY_BLOCKS;
+    history.count = 1;
+  }
+  history.flushing = false;
+}
+
+// Drive geometry of the 500/600 series
+#define ENCODER_COUNTS_PER_MM (508.8 / (72.0 * PI))
+#define WHEEL_BASE 235.0 // mm
+
+void startSession(Robot &robot) {
+  const RoombaState &state = robot.state;
+  Session &session = robot.session;
+  memset(&session, 0, sizeof(session));
+  session.active = true;
+  session.startTime = state.timestamp;
+  session.lastCleaningTime = state.timestamp;
+  session.lastTime = state.timestamp;
+  session.startEpoch = time(nullptr) >= 8 * 3600 * 2 ? time(nullptr) : 0;
+  session.leftCounts = state.leftEncoderCounts;
+  session.rightCounts = state.rightEncoderCounts;
+  session.startCharge = state.charge;
+  DLOG("Roomba %d cleaning session started\n", robot.index);
+}
+
+// Marks the grid cell under the Roomba. Cells off the grid aren't counted.
+void coverCell(Session &session) {
+  int32_t column = (int32_t)floor(session.x / SESSION_GRID_CELL) + SESSION_GRID_SIZE / 2;
+  int32_t row = (int32_t)floor(session.y / SESSION_GRID_CELL) + SESSION_GRID_SIZE / 2;
+  if (column < 0 || column >= SESSION_GRID_SIZE || row < 0 || row >= SESSION_GRID_SIZE) {
+    return;
+  }
+  uint16_t cell = row * SESSION_GRID_SIZE + column;
+  uint8_t bit = 1 << (cell % 8);
+  if (!(session.grid[cell / 8] & bit)) {
+    session.grid[cell / 8] |= bit;
+    session.cellsCovered++;
+  }
+}
+
+// Dead reckoning from one frame's worth of encoder counts, distance and angle
+void integrateSession(Robot &robot) {
+  const RoombaState &state = robot.state;
+  Session &session = robot.session;
+  // The counts wrap around, the difference as a signed 16 bit number doesn't care
+  float left = (int16_t)(state.leftEncoderCounts - session.leftCounts) / ENCODER_COUNTS_PER_MM;
+  float right = (int16_t)(state.rightEncoderCounts - session.rightCounts) / ENCODER_COUNTS_PER_MM;
+  session.leftCounts = state.leftEncoderCounts;
+  session.rightCounts = state.rightEncoderCounts;
+  float turn = (right - left) / WHEEL_BASE;
+  float heading = session.heading + turn / 2;
+  session.x += (left + right) / 2 * cos(heading);
+  session.y += (left + right) / 2 * sin(heading);
+  session.heading += turn;
+  coverCell(session);
+
+  session.distance += state.distance;
+  session.turned += abs(state.angle);
+  // mV * mA is uW, and uW * ms / 3.6e9 is mWh
+  session.energy -= (float)state.voltage * state.current * (state.timestamp - session.lastTime) / 3.6e9;
+  session.lastTime = state.timestamp;
+}
+
+void sendSession(Robot &robot) {
+  const RoombaState &state = robot.state;
+  const Session &session = robot.session;
+  StaticJsonDocument<JSON_OBJECT_SIZE(10)> root;
+  if (session.startEpoch) {
+    root["start"] = (uint32_t)session.startEpoch;
+  }
+  root["duration"] = (session.lastCleaningTime - session.startTime) / 1000;
+  root["distance"] = session.distance;
+  root["area"] = session.cellsCovered * ((float)SESSION_GRID_CELL * SESSION_GRID_CELL / 1e6);
+  root["turned"] = session.turned;
+  root["charge_used"] = session.startCharge - state.charge;
+  root["energy"] = (int32_t)session.energy;
+  root["x"] = (int32_t)session.x;
+  root["y"] = (int32_t)session.y;
+  root["docked"] = state.docked;
+  publishJson(robot.sessionTopic.name, root, MessageSession);
+  DLOG("Roomba %d session: %s\n", robot.index, mqttPayload);
+}
+
+// Starts, integrates and ends cleaning sessions, called for every sensor frame
+void updateSession(Robot &robot) {
+  const RoombaState &state = robot.state;
+  Session &session = robot.session;
+  if (!session.active) {
+    if (state.cleaning) {
+      startSession(robot);
+    }
+    return;
+  }
+  integrateSession(robot);
+  if (state.cleaning) {
+    session.lastCleaningTime = state.timestamp;
+  } else if (state.docked || state.timestamp - session.lastCleaningTime > SESSION_END_TIMEOUT) {
+    sendSession(robot);
+    session.active = false;
+  }
+}
+
+// Edge detection on the sensor bits that matter for safety. A source has to read
+// the same for EVENT_DEBOUNCE_FRAMES frames in a row before its level changes, and
+// the change is published on the event topic from the same loop(). Activations of a
+// source are published at most every EVENT_MIN_INTERVAL ms, and a release only if
+// its activation was. The packets have to be in the sensor list, see defaultSensors.
+typedef struct {
+  const char *name;
+  uint8_t offset; // Of the byte in Roomba::SensorValues
+  uint8_t mask;
+} EventSource;
+
+#define EVENT_FIELD(member) offsetof(Roomba::SensorValues, member)
+
+const EventSource eventSources[EVENT_SOURCES] = {
+  {"bump_right", EVENT_FIELD(bumpsAndWheelDrops), ROOMBA_MASK_BUMP_RIGHT},
+  {"bump_left", EVENT_FIELD(bumpsAndWheelDrops), ROOMBA_MASK_BUMP_LEFT},
+  {"wheel_drop_right", EVENT_FIELD(bumpsAndWheelDrops), ROOMBA_MASK_WHEELDROP_RIGHT},
+  {"wheel_drop_left", EVENT_FIELD(bumpsAndWheelDrops), ROOMBA_MASK_WHEELDROP_LEFT},
+  {"wheel_drop_caster", EVENT_FIELD(bumpsAndWheelDrops), ROOMBA_MASK_WHEELDROP_CASTER},
+  {"cliff_left", EVENT_FIELD(cliffLeft), 1},
+  {"cliff_front_left", EVENT_FIELD(cliffFrontLeft), 1},
+  {"cliff_front_right", EVENT_FIELD(cliffFrontRight), 1},
+  {"cliff_right", EVENT_FIELD(cliffRight), 1},
+  {"virtual_wall", EVENT_FIELD(virtualWall), 1},
+  {"overcurrent_left_wheel", EVENT_FIELD(overcurrents), ROOMBA_MASK_LEFT_WHEEL},
+  {"overcurrent_right_wheel", EVENT_FIELD(overcurrents), ROOMBA_MASK_RIGHT_WHEEL},
+};
+
+static_assert(EVENT_SOURCES <= 16, "event levels are a 16 bit mask");
+
+void sendEvent(Robot &robot, const EventSource &source, bool active) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(2)> root;
+  root["event"] = source.name;
+  root["active"] = active;
+  publishJson(robot.eventTopic.name, root, MessageEvent);
+  DLOG("Roomba %d event %s %s\n", robot.index, source.name, active ? "on" : "off");
+}
+
+// Called for every sensor frame
+void updateEvents(Robot &robot) {
+  const uint8_t *values = (const uint8_t *)(const Roomba::SensorValues *)&robot.state;
+  Events &events = robot.events;
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < EVENT_SOURCES; i++) {
+    const EventSource &source = eventSources[i];
+    uint16_t bit = 1 << i;
+    bool active = values[source.offset] & source.mask;
+    if (active == ((events.levels & bit) != 0)) {
+      events.frames[i] = 0;
+      continue;
+    }
+    if (++events.frames[i] < EVENT_DEBOUNCE_FRAMES) {
+      continue;
+    }
+    events.frames[i] = 0;
+    events.levels ^= bit;
+    if (active) {
+      if (events.lastTime[i] && now - events.lastTime[i] < EVENT_MIN_INTERVAL) {
+        continue;
+      }
+      events.lastTime[i] = now;
+      events.reported |= bit;
+      sendEvent(robot, source, true);
+    } else if (events.reported & bit) {
+      events.reported &= ~bit;
+      sendEvent(robot, source, false);
+    }
+  }
+}
+
+bool isCharging(const RoombaState &state);
+
+// Resting voltage of the 12 cell NiMH pack against state of charge. It's flat
+// in the middle, so it mostly matters when the charge reading can't be trusted.
+const struct {
+  uint16_t voltage; // mV
+  uint8_t level; // %
+} batteryCurve[] = {
+  {10800, 0}, {13200, 5}, {14200, 15}, {15000, 50}, {15600, 80}, {16200, 100},
+};
+
+float voltageSoc(float voltage) {
+  const uint8_t points = sizeof(batteryCurve) / sizeof(batteryCurve[0]);
+  if (voltage <= batteryCurve[0].voltage) {
+    return 0;
+  }
+  for (uint8_t i = 1; i < points; i++) {
+    if (voltage < batteryCurve[i].voltage) {
+      float t = (voltage - batteryCurve[i - 1].voltage) / (batteryCurve[i].voltage - batteryCurve[i - 1].voltage);
+      return (batteryCurve[i - 1].level + t * (batteryCurve[i].level - batteryCurve[i - 1].level)) / 100;
+    }
+  }
+  return 1;
+}
+
+// Moves value towards target as a first order filter with time constant tau would over dt
+void pullTowards(float &value, float target, float dt, float tau) {
+  value += (target - value) * dt / (tau + dt);
+}
+
+// Pulls the state of charge towards what a resting voltage says
+void restingVoltage(Battery &battery, float voltage) {
+  unsigned long now = millis();
+  pullTowards(battery.soc, voltageSoc(voltage), now - battery.lastTime, BATTERY_VOLTAGE_TAU);
+  battery.soc = constrain(battery.soc, 0.0f, 1.0f);
+  battery.lastTime = now;
+}
+
+// Minutes until empty at the filtered current, 0 unless discharging
+uint16_t minutesToEmpty(const Battery &battery) {
+  if (!battery.valid || battery.current > -BATTERY_REST_CURRENT) {
+    return 0;
+  }
+  return battery.soc * battery.capacity * 60 / -battery.current;
+}
+
+// Minutes until full at the filtered current, 0 unless charging
+uint16_t minutesToFull(const Battery &battery) {
+  if (!battery.valid || battery.current < BATTERY_REST_CURRENT) {
+    return 0;
+  }
+  return (1 - battery.soc) * battery.capacity * 60 / battery.current;
+}
+
+// Feeds a frame to the battery model
+void updateBattery(Robot &robot) {
+  RoombaState &state = robot.state;
+  Battery &battery = robot.battery;
+  unsigned long now = millis();
+  if (state.capacity) {
+    battery.capacity = state.capacity;
+  } else if (!battery.capacity) {
+    battery.capacity = BATTERY_CAPACITY;
+  }
+  // The charge reading wraps round below 0 and overshoots the capacity when
+  // full, so only readings from 0 to a little over the capacity are believed
+  bool chargeValid = state.capacity && state.charge >= 0 && state.charge <= state.capacity + state.capacity / 10;
+  float chargeSoc = chargeValid ? min(1.0f, (float)state.charge / state.capacity) : 0;
+  bool resting = abs(state.current) < BATTERY_REST_CURRENT && !isCharging(state);
+  if (!battery.valid) {
+    battery.valid = true;
+    battery.soc = chargeValid ? chargeSoc : voltageSoc(state.voltage);
+    battery.current = state.current;
+  } else {
+    float dt = now - battery.lastTime;
+    // mA over ms, as a fraction of the capacity in mAh
+    battery.soc += state.current * dt / (battery.capacity * 3.6e6f);
+    if (chargeValid) {
+      pullTowards(battery.soc, chargeSoc, dt, BATTERY_CHARGE_TAU);
+    }
+    if (resting) {
+      pullTowards(battery.soc, voltageSoc(state.voltage), dt, BATTERY_VOLTAGE_TAU);
+    }
+    pullTowards(battery.current, state.current, dt, BATTERY_CURRENT_TAU);
+  }
+  battery.soc = constrain(battery.soc, 0.0f, 1.0f);
+  battery.lastTime = now;
+  uint16_t toEmpty = minutesToEmpty(battery);
+  state.batteryLow = battery.soc * 100 < BATTERY_LOW_LEVEL || (toEmpty && toEmpty < BATTERY_LOW_TIME);
+}
+
+// Battery voltage on A0, one reading at a time so loop() never waits on it
+typedef struct {
+  float voltage; // mV, filtered
+  unsigned long lastTime;
+} Adc;
+
+Adc adc;
+
+// Averages a quick burst, so the check at boot has something to go on
+void seedADC() {
+  uint32_t sum = 0;
+  for (int i = 0; i < ADC_BOOT_SAMPLES; i++) {
+    sum += analogRead(A0);
+  }
+  adc.voltage = sum * ADC_VOLTAGE_DIVIDER / ADC_BOOT_SAMPLES;
+  adc.lastTime = millis();
+}
+
+void updateADC() {
+  unsigned long now = millis();
+  if (now - adc.lastTime < ADC_SAMPLE_INTERVAL) {
+    return;
+  }
+  adc.lastTime = now;
+  int reading = analogRead(A0);
+  adc.voltage += (reading * ADC_VOLTAGE_DIVIDER - adc.voltage) * ADC_FILTER;
+#ifdef ENABLE_ADC_SLEEP
+  // A0 is wired to the first Roomba's battery, which is all there is to go
+  // on once its stream goes quiet for as long as the stale check in loop() allows
+  Robot &robot = robots[0];
+  if (robot.battery.valid && now - robot.state.timestamp > stateStaleTimeout()) {
+    restingVoltage(robot.battery, adc.voltage);
+  }
+#endif
+}
+
+// Sends the Roombas the time, once NTP has set it
+void setDateTime() {
+  time_t local = tz.toLocal(time(nullptr));
+  // Queued so it lands after any pending wakeup
+  uint8_t dayTime[] = {168, (uint8_t)(dayOfWeek(local)-1), (uint8_t)hour(local), (uint8_t)minute(local)};
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    queueStep(robots[i], 0, CommandStepWrite, dayTime, sizeof(dayTime));
+  }
+}
+
+// Duty cycling. While every Roomba sits docked and idle the ESP deep sleeps
+// for DUTY_CYCLE_SLEEP, then wakes just long enough to poll the sensors and
+// publish whatever changed. What it needs to carry on where it left off is
+// kept in RTC user memory, which survives deep sleep but not a power cycle.
+#if defined(DUTY_CYCLE) && !defined(ADAPTIVE_STREAM)
+#error "DUTY_CYCLE polls the sensors, it needs ADAPTIVE_STREAM"
+#endif
+
+#define RTC_STATE_MAGIC 0x52424d52
+
+typedef struct {
+  RoombaState lastSentState;
+  uint32_t sincePublish; // ms from the last publish to the end of the sleep
+  uint8_t songSlots;
+  uint32_t configHash; // Of the discovery config last published
+} RtcRobotState;
+
+typedef struct {
+  uint32_t magic; // RTC_STATE_MAGIC
+  uint32_t wakeups; // Since the ESP last started normally
+  uint32_t awakeTime; // ms from boot to sleep of the last wakeup
+  uint32_t publishes;
+  uint32_t reconnects;
+  uint32_t wakeEpoch; // UTC time the sleep ends, 0 if the time wasn't known
+  uint16_t wakeMillis; // and the ms past that second
+  RtcRobotState robots[ROBOT_COUNT];
+  uint32_t checksum; // Must stay last
+} RtcState;
+
+static_assert(sizeof(RtcState) <= 512, "RTC user memory only holds 512 bytes");
+
+RtcState rtcState;
+bool dutyCycleWake = false; // Woken from a duty cycle sleep rather than started normally
+unsigned long dockedIdleTime = 0; // When the Roombas were last seen busy
+
+// NTP is polled from loop() instead of waited for. After a wakeup the clock
+// is already set, so it's the SNTP callback that says the time came from NTP.
+bool timeSyncPending = false;
+unsigned long timeSyncStartTime = 0;
+volatile bool timeSynced = false;
+
+void onTimeSynced() {
+  timeSynced = true;
+}
+
+void startTimeSync() {
+  timeSynced = false;
+  settimeofday_cb(onTimeSynced);
+  configTime(0, 0, NTP_SERVER_1, NTP_SERVER_2);
+  timeSyncPending = true;
+  timeSyncStartTime = millis();
+}
+
+void planSchedule(Robot &robot, time_t after = 0);
+void planSchedules(time_t after = 0);
+
+void updateTimeSync() {
+  if (!timeSyncPending) {
+    return;
+  }
+  if (timeSynced && time(nullptr) >= 8 * 3600 * 2) {
+    timeSyncPending = false;
+    DLOG("Time synced in %lums\n", millis() - timeSyncStartTime);
+    if (dutyCycleWake) {
+      // Only the clock was corrected. Catch a job it jumped over, without running
+      // one again that already ran by the carried over clock. The Roombas kept
+      // their own clocks, and commands to them would keep the ESP awake.
+      time_t now = time(nullptr);
+      for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+        planSchedule(robots[i], max(now - 1, robots[i].schedule.lastRun));
+      }
+      return;
+    }
+    for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+      wakeup(robots[i]);
+    }
+    setDateTime();
+    planSchedules();
+  } else if (millis() - timeSyncStartTime > NTP_TIMEOUT) {
+    DLOG("No time from NTP, asking again\n");
+    startTimeSync();
+  }
+}
+
+// ms the link has spent down since boot
+uint32_t linkDownTime(const Link &link) {
+  return link.downTotal + (link.up ? 0 : millis() - link.downTime);
+}
+
+// Stats go out as three messages, grouped so that each stays under
+// MQTT_MAX_PACKET_SIZE with every counter at its widest (10 digits)
+void sendStats() {
+  // Stream counters are summed over all Roombas
+  Roomba::StreamStats stream = {};
+  uint32_t baudProbes = 0;
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    const Roomba::StreamStats &robotStream = robots[i].roomba.streamStats();
+    stream.frames += robotStream.frames;
+    stream.checksumErrors += robotStream.checksumErrors;
+    stream.frameErrors += robotStream.frameErrors;
+    stream.rxOverruns += robotStream.rxOverruns;
+    stream.bytes += robotStream.bytes;
+    stream.rescans += robotStream.rescans;
+    baudProbes += robots[i].baudProbes;
+    stream.rxHighWater = max(stream.rxHighWater, robotStream.rxHighWater);
+  }
+  StaticJsonDocument<JSON_OBJECT_SIZE(13)> root;
+  root["uptime"] = millis() / 1000;
+  root["first_state"] = firstStateTime;
+#ifdef DUTY_CYCLE
+  root["wakeups"] = rtcState.wakeups;
+  root["awake_time"] = rtcState.awakeTime;
+#endif
+  root["publishes"] = loopStats.publishes;
+  root["reconnects"] = loopStats.reconnects;
+  root["wifi_reconnects"] = wifiLink.reconnects;
+  root["wifi_down"] = linkDownTime(wifiLink) / 1000;
+  root["mqtt_down"] = linkDownTime(mqttLink) / 1000;
+  root["queued"] = publishQueueCount();
+  root["queue_drops"] = publishDrops;
+#if LOGGING
+  root["log_drops"] = logRing.drops;
+#endif
+  root["free_heap"] = ESP.getFreeHeap();
+  publishJson(statsTopic.name, root, MessageStats);
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(8)> streamRoot;
+  streamRoot["frames"] = stream.frames;
+  streamRoot["checksum_errors"] = stream.checksumErrors;
+  streamRoot["frame_errors"] = stream.frameErrors;
+  streamRoot["rx_overruns"] = stream.rxOverruns;
+  streamRoot["rx_high_water"] = stream.rxHighWater;
+  streamRoot["rx_bytes"] = stream.bytes;
+  streamRoot["rescans"] = stream.rescans;
+  streamRoot["baud_probes"] = baudProbes;
+  publishJson(statsStreamTopic.name, streamRoot, MessageStats);
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(1 + LoopStageCount) + LoopStageCount * JSON_ARRAY_SIZE(3) + JSON_ARRAY_SIZE(LATENCY_BUCKETS)> loopRoot;
+  for (int i = 0; i < LoopStageCount; i++) {
+    uint32_t min, avg, max;
+    stageMicros(loopStats.stages[i], &min, &avg, &max);
+    JsonArray stage = loopRoot.createNestedArray(loopStageNames[i]);
+    stage.add(min);
+    stage.add(avg);
+    stage.add(max);
+  }
+  JsonArray histogram = loopRoot.createNestedArray("latency");
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    histogram.add(loopStats.latencyHistogram[i]);
+  }
+  // The loop timings start over once they're out
+  if (publishJson(statsLoopTopic.name, loopRoot, MessageStats)) {
+    resetLoopStats();
+  }
+}
+
+// Commands from MQTT and telnet. Handlers get the Roomba the command is for
+// and the arg of their table row.
+typedef void (*CommandHandler)(Robot &robot, uint32_t arg);
+
+typedef enum {
+  CommandFlagMQTT   = 0x1, // Can be sent over MQTT, not just telnet
+  CommandFlagWakeup = 0x2, // Wake the Roomba before running the command
+} CommandFlags;
+
+typedef struct {
+  const char *name;
+  CommandHandler handler;
+  uint32_t arg;
+  uint8_t flags; // CommandFlags
+} Command;
+
+void cmdTurnOn(Robot &robot, uint32_t) {
+  DLOG("Turning on\n");
+  queueWrite(robot, 0, 135); // Clean
+  robot.state.cleaning = true;
+}
+
+void cmdTurnOff(Robot &robot, uint32_t) {
+  DLOG("Turning off\n");
+  queueWrite(robot, 0, 133); // Power
+  robot.state.cleaning = false;
+}
+
+void cmdToggle(Robot &robot, uint32_t) {
+  DLOG("Toggling\n");
+  queueWrite(robot, 0, 135); // Clean
+}
+
+void cmdStop(Robot &robot, uint32_t) {
+  if (robot.state.cleaning) {
+    DLOG("Stopping\n");
+    queueWrite(robot, 0, 135); // Clean
+  } else {
+    DLOG("Not cleaning, can't stop\n");
+  }
+}
+
+void cmdCleanSpot(Robot &robot, uint32_t) {
+  DLOG("Cleaning Spot\n");
+  robot.state.cleaning = true;
+  queueWrite(robot, 0, 134); // Spot
+}
+
+// Plays the locate songs one after the other
+void cmdLocate(Robot &robot, uint32_t) {
+  DLOG("Playing the locate songs\n");
+  queueWrite(robot, 0, 131); // Safe mode
+  uint16_t delay = 50;
+  for (uint8_t i = 0; i < SONG_COUNT; i++) {
+    delay = queueSong(robot, delay, i);
+  }
+}
+
+void cmdReturnToBase(Robot &robot, uint32_t) {
+  DLOG("Returning to Base\n");
+  robot.state.cleaning = true;
+  queueWrite(robot, 0, 143); // Dock
+}
+
+void cmdQuit(Robot &robot, uint32_t) {
+  DLOG("Stopping Roomba\n");
+  queueWrite(robot, 0, 173); // Stop
+}
+
+void cmdRoombaReset(Robot &robot, uint32_t) {
+  DLOG("Resetting Roomba\n");
+  robot.roomba.reset();
+  robot.songSlots = 0; // Forgotten by the reset
+}
+
+void cmdMQTTHello(Robot &robot, uint32_t) {
+  mqttClient.publish("vacuum/hello", "hello there");
+}
+
+void cmdVersion(Robot &robot, uint32_t) {
+  const char compile_date[] = __DATE__ " " __TIME__;
+  DLOG("Compiled on: %s\n", compile_date);
+}
+
+// Through the Roomba class, so start() and checkLink() carry on at the new rate
+void cmdBaud(Robot &robot, uint32_t code) {
+  Roomba::Baud baud = (Roomba::Baud)code;
+  DLOG("Setting baud to %u\n", robot.roomba.baudCodeToBaudRate(baud));
+  if (!robot.roomba.serialBaud(baud)) {
+    DLOG("Roomba %d is on SoftwareSerial, its rate is fixed\n", robot.index);
+    return;
+  }
+  for (uint8_t i = 0; i < sizeof(probeBauds) / sizeof(probeBauds[0]); i++) {
+    if (probeBauds[i] == baud) {
+      robot.baudIndex = i;
+    }
+  }
+  robot.linkFailures = 0;
+}
+
+void cmdSleep(Robot &, uint32_t seconds) {
+  DLOG("Going to sleep for %u seconds\n", seconds);
+  flushLog();
+  delay(100);
+  ESP.deepSleep(seconds * 1e6);
+}
+
+void cmdWake(Robot &robot, uint32_t) {
+  DLOG("Toggle BRC pin\n");
+  wakeup(robot);
+}
+
+void cmdReadADC(Robot &robot, uint32_t) {
+  DLOG("ADC voltage is %.1fmV\n", adc.voltage);
+}
+
+void cmdStreamResume(Robot &robot, uint32_t) {
+  DLOG("Resume streaming\n");
+  robot.roomba.streamCommand(Roomba::StreamCommandResume);
+}
+
+void cmdStreamPause(Robot &robot, uint32_t) {
+  DLOG("Pause streaming\n");
+  robot.roomba.streamCommand(Roomba::StreamCommandPause);
+}
+
+void cmdStream(Robot &robot, uint32_t) {
+  DLOG("Requesting stream\n");
+  robot.roomba.stream(settings.sensors, settings.sensorCount);
+}
+
+void cmdStreamReset(Robot &robot, uint32_t) {
+  DLOG("Resetting stream\n");
+  robot.roomba.stream({}, 0);
+}
+
+void cmdTime(Robot &robot, uint32_t) {
+  startTimeSync();
+}
+
+void cmdHeap(Robot &robot, uint32_t) {
+  DLOG("Free heap %u bytes, max free block %u bytes, fragmentation %u%%\n", ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation());
+}
+
+void cmdHistory(Robot &robot, uint32_t) {
+  DLOG("Flushing history, %d blocks\n", robot.history.count);
+  robot.history.flushing = true;
+  robot.history.flushIndex = 0;
+  robot.history.flushFileOffset = 0;
+}
+
+void cmdLoopTime(Robot &robot, uint32_t) {
+  for (int i = 0; i < LoopStageCount; i++) {
+    uint32_t min, avg, max;
+    stageMicros(loopStats.stages[i], &min, &avg, &max);
+    DLOG("%-8s min %uus avg %uus max %uus\n", loopStageNames[i], min, avg, max);
+  }
+  DLOG("%d command steps queued\n", robot.commandQueueCount);
+}
+
+#define MQTT_COMMAND (CommandFlagMQTT | CommandFlagWakeup)
+
+// Must stay sorted by name, lookups are a binary search
+constexpr Command commands[] = {
+  {"baud115200", cmdBaud, Roomba::Baud115200, 0},
+  {"baud19200", cmdBaud, Roomba::Baud19200, 0},
+  {"baud38400", cmdBaud, Roomba::Baud38400, 0},
+  {"baud57600", cmdBaud, Roomba::Baud57600, 0},
+  {"clean_spot", cmdCleanSpot, 0, MQTT_COMMAND},
+  {"heap", cmdHeap, 0, 0},
+  {"history", cmdHistory, 0, CommandFlagMQTT},
+  {"locate", cmdLocate, 0, MQTT_COMMAND},
+  {"looptime", cmdLoopTime, 0, 0},
+  {"mqtthello", cmdMQTTHello, 0, 0},
+  {"pause", cmdToggle, 0, MQTT_COMMAND},
+  {"quit", cmdQuit, 0, 0},
+  {"readadc", cmdReadADC, 0, 0},
+  {"return_to_base", cmdReturnToBase, 0, MQTT_COMMAND},
+  {"rreset", cmdRoombaReset, 0, 0},
+  {"sleep5", cmdSleep, 5, 0},
+  {"start", cmdToggle, 0, MQTT_COMMAND},
+  {"stop", cmdStop, 0, MQTT_COMMAND},
+  {"stream", cmdStream, 0, 0},
+  {"streampause", cmdStreamPause, 0, 0},
+  {"streamreset", cmdStreamReset, 0, 0},
+  {"streamresume", cmdStreamResume, 0, 0},
+  {"time", cmdTime, 0, 0},
+  {"turn_off", cmdTurnOff, 0, MQTT_COMMAND},
+  {"turn_on", cmdTurnOn, 0, MQTT_COMMAND},
+  {"version", cmdVersion, 0, 0},
+  {"wake", cmdWake, 0, 0},
+};
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+constexpr bool namesAscending(const char *a, const char *b) {
+  return *a == *b ? (*a != 0 && namesAscending(a + 1, b + 1)) : (uint8_t)*a < (uint8_t)*b;
+}
+
+constexpr bool commandsSorted(size_t i) {
+  return i + 1 >= COMMAND_COUNT || (namesAscending(commands[i].name, commands[i + 1].name) && commandsSorted(i + 1));
+}
+
+static_assert(commandsSorted(0), "commands must be sorted by name");
+
+// Binary search for a command, name doesn't need to be null terminated
+const Command *findCommand(const char *name, size_t length) {
+  int low = 0;
+  int high = COMMAND_COUNT - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    const char *candidate = commands[mid].name;
+    int cmp = strncmp(name, candidate, length);
+    if (cmp == 0 && candidate[length] != 0) {
+      cmp = -1; // name is a prefix of candidate
+    }
+    if (cmp == 0) {
+      return &commands[mid];
+    } else if (cmp < 0) {
+      high = mid - 1;
+    } else {
+      low = mid + 1;
+    }
+  }
+  return NULL;
+}
+
+// Runs a command for robot if it has all of requiredFlags
+bool runCommand(Robot &robot, const char *name, size_t length, uint8_t requiredFlags) {
+  const Command *command = findCommand(name, length);
+  if (!command || (command->flags & requiredFlags) != requiredFlags) {
+    return false;
+  }
+  if (command->flags & CommandFlagWakeup) {
+    // Everything is queued behind the wakeup so it reaches an awake Roomba
+    wakeup(robot);
+    // Whatever the command does, it's worth watching at the full stream rate
+    setSensorMode(robot, SensorModeStream);
+  }
+  command->handler(robot, command->arg);
+  return true;
+}
+
+// Runs one of the MQTT protocol commands
+bool performCommand(Robot &robot, const char *name, size_t length) {
+  return runCommand(robot, name, length, CommandFlagMQTT);
+}
+
+// The local schedule. Each Roomba's jobs are kept in a file of its own, and
+// nextFire is worked out whenever the jobs or the clock change, so loop() only
+// has to compare it with the time.
+#define SCHEDULE_VERSION 1
+
+const char *dayNames[7] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+bool timeKnown() {
+  return time(nullptr) >= 8 * 3600 * 2;
+}
+
+void scheduleFileName(const Robot &robot, char *name, size_t size) {
+  snprintf(name, size, "/schedule%d.bin", robot.index);
+}
+
+// When entry is next due strictly after the UTC time after
+time_t nextEntryTime(const ScheduleEntry &entry, time_t after) {
+  time_t local = tz.toLocal(after);
+  time_t midnight = local - (hour(local) * 3600 + minute(local) * 60 + second(local));
+  uint8_t today = dayOfWeek(local) - 1;
+  for (uint8_t day = 0; day <= 7; day++) {
+    time_t candidate = midnight + day * 86400L + entry.hour * 3600L + entry.minute * 60L;
+    if (candidate > local && (entry.days & (1 << ((today + day) % 7)))) {
+      return tz.toUTC(candidate);
+    }
+  }
+  return 0;
+}
+
+// Plans the next job after the given time, or after now if that's 0
+void planSchedule(Robot &robot, time_t after) {
+  Schedule &schedule = robot.schedule;
+  schedule.nextFire = 0;
+  if (!timeKnown()) {
+    return;
+  }
+  time_t now = after ? after : time(nullptr);
+  for (uint8_t i = 0; i < schedule.count; i++) {
+    time_t fire = nextEntryTime(schedule.entries[i], now);
+    if (fire && (!schedule.nextFire || fire < schedule.nextFire)) {
+      schedule.nextFire = fire;
+    }
+  }
+  if (schedule.nextFire) {
+    DLOG("Roomba %d next scheduled job in %lds\n", robot.index, (long)(schedule.nextFire - now));
+  }
+}
+
+void planSchedules(time_t after) {
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    planSchedule(robots[i], after);
+  }
+}
+
+void sendSchedule(const Robot &robot) {
+  const Schedule &schedule = robot.schedule;
+  StaticJsonDocument<JSON_ARRAY_SIZE(SCHEDULE_ENTRIES) + SCHEDULE_ENTRIES * (JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(7)) + SCHEDULE_ENTRIES * 6> root;
+  JsonArray list = root.to<JsonArray>();
+  for (uint8_t i = 0; i < schedule.count; i++) {
+    const ScheduleEntry &entry = schedule.entries[i];
+    JsonObject item = list.createNestedObject();
+    JsonArray days = item.createNestedArray("days");
+    for (uint8_t day = 0; day < 7; day++) {
+      if (entry.days & (1 << day)) {
+        days.add(dayNames[day]);
+      }
+    }
+    char time[6];
+    snprintf(time, sizeof(time), "%02d:%02d", entry.hour, entry.minute);
+    item["time"] = time; // A char * is copied into the document, it's a local
+    item["command"] = entry.command;
+  }
+  publishJson(robot.scheduleTopic.name, root, MessageSchedule);
+}
+
+void saveSchedule(const Robot &robot) {
+  char name[20];
+  scheduleFileName(robot, name, sizeof(name));
+  File file = LittleFS.open(name, "w");
+  if (!file) {
+    DLOG("Can't write %s\n", name);
+    return;
+  }
+  uint8_t header[2] = {SCHEDULE_VERSION, robot.schedule.count};
+  file.write(header, sizeof(header));
+  file.write((const uint8_t *)robot.schedule.entries, robot.schedule.count * sizeof(ScheduleEntry));
+  file.close();
+}
+
+void loadSchedule(Robot &robot) {
+  Schedule &schedule = robot.schedule;
+  schedule.count = 0;
+  char name[20];
+  scheduleFileName(robot, name, sizeof(name));
+  File file = LittleFS.open(name, "r");
+  if (!file) {
+    return;
+  }
+  uint8_t header[2];
+  if (file.read(header, sizeof(header)) == sizeof(header)
+      && header[0] == SCHEDULE_VERSION && header[1] <= SCHEDULE_ENTRIES) {
+    size_t size = header[1] * sizeof(ScheduleEntry);
+    if (file.read((uint8_t *)schedule.entries, size) == size) {
+      schedule.count = header[1];
+    }
+  }
+  file.close();
+  DLOG("Roomba %d has %d scheduled jobs\n", robot.index, schedule.count);
+}
+
+// Parses "HH:MM"
+bool parseScheduleTime(const char *text, ScheduleEntry &entry) {
+  if (!text || strlen(text) != 5 || text[2] != ':') {
+    return false;
+  }
+  for (uint8_t i = 0; i < 5; i++) {
+    if (i != 2 && (text[i] < '0' || text[i] > '9')) {
+      return false;
+    }
+  }
+  entry.hour = (text[0] - '0') * 10 + text[1] - '0';
+  entry.minute = (text[3] - '0') * 10 + text[4] - '0';
+  return entry.hour < 24 && entry.minute < 60;
+}
+
+bool parseScheduleEntry(JsonObject item, ScheduleEntry &entry) {
+  const char *command = item["command"];
+  if (!parseScheduleTime(item["time"], entry) || !command || strlen(command) >= sizeof(entry.command)) {
+    return false;
+  }
+  const Command *found = findCommand(command, strlen(command));
+  if (!found || !(found->flags & CommandFlagMQTT)) {
+    return false;
+  }
+  strcpy(entry.command, command);
+  entry.days = 0;
+  JsonArray days = item["days"];
+  for (size_t i = 0; i < days.size(); i++) {
+    const char *name = days[i];
+    uint8_t day = 0;
+    while (day < 7 && !(name && strcmp(name, dayNames[day]) == 0)) {
+      day++;
+    }
+    if (day == 7) {
+      return false;
+    }
+    entry.days |= 1 << day;
+  }
+  return entry.days != 0;
+}
+
+// Replaces the whole schedule with a JSON list of jobs, see the README.
+// Nothing changes unless every job is valid.
+void setSchedule(Robot &robot, const byte *payload, unsigned int length) {
+  StaticJsonDocument<JSON_ARRAY_SIZE(SCHEDULE_ENTRIES) + SCHEDULE_ENTRIES * (JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(7)) + SCHEDULE_ENTRIES * 64> root;
+  DeserializationError error = deserializeJson(root, payload, length);
+  if (error) {
+    DLOG("Bad schedule: %s\n", error.c_str());
+    return;
+  }
+  JsonArray list = root.as<JsonArray>();
+  if (list.isNull() || list.size() > SCHEDULE_ENTRIES) {
+    DLOG("A schedule is a list of at most %d jobs\n", SCHEDULE_ENTRIES);
+    return;
+  }
+  Schedule schedule = {};
+  for (size_t i = 0; i < list.size(); i++) {
+    if (!parseScheduleEntry(list[i], schedule.entries[schedule.count++])) {
+      DLOG("Bad scheduled job %d\n", (int)i);
+      return;
+    }
+  }
+  robot.schedule = schedule;
+  saveSchedule(robot);
+  planSchedule(robot);
+  sendSchedule(robot);
+}
+
+// Runs the jobs that are due, usually just compares nextFire with the time
+void updateSchedule(Robot &robot) {
+  Schedule &schedule = robot.schedule;
+  if (!schedule.nextFire || time(nullptr) < schedule.nextFire) {
+    return;
+  }
+  // Every job due at the same minute runs
+  for (uint8_t i = 0; i < schedule.count; i++) {
+    const ScheduleEntry &entry = schedule.entries[i];
+    if (nextEntryTime(entry, schedule.nextFire - 1) == schedule.nextFire) {
+      DLOG("Roomba %d scheduled %s\n", robot.index, entry.command);
+      performCommand(robot, entry.command, strlen(entry.command));
+    }
+  }
+  schedule.lastRun = schedule.nextFire;
+  planSchedule(robot);
+}
+
+#define SETTINGS_FILE "/settings.bin"
+
+void buildConfigs();
+void setupEntityTopics();
+
+bool restartPending = false; // Settings changed that only apply after a restart
+
+uint32_t settingsChecksum(const Settings &blob) {
+  const uint8_t *p = (const uint8_t *)&blob;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(blob) - sizeof(blob.checksum); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void defaultSettings(Settings &blob) {
+  memset(&blob, 0, sizeof(blob));
+  blob.version = SETTINGS_VERSION;
+  blob.size = sizeof(blob);
+  strlcpy(blob.mqttServer, MQTT_SERVER, sizeof(blob.mqttServer));
+  blob.mqttPort = MQTT_PORT;
+  strlcpy(blob.mqttUser, MQTT_USER, sizeof(blob.mqttUser));
+  strlcpy(blob.mqttPassword, MQTT_PASSWORD, sizeof(blob.mqttPassword));
+  blob.brcPin = BRC_PIN;
+  strlcpy(blob.model, ROOMBA_MODEL, sizeof(blob.model));
+  static_assert(sizeof(defaultSensors) <= SETTINGS_SENSORS_MAX, "too many default sensors");
+  blob.sensorCount = sizeof(defaultSensors);
+  memcpy(blob.sensors, defaultSensors, sizeof(defaultSensors));
+  blob.heartbeatInterval = STATUS_HEARTBEAT_INTERVAL;
+  blob.statusMinInterval = STATUS_MIN_INTERVAL;
+  blob.currentDelta = STATUS_CURRENT_DELTA;
+  blob.voltageDelta = STATUS_VOLTAGE_DELTA;
+  blob.chargeDelta = STATUS_CHARGE_DELTA;
+  blob.streamIdleTimeout = STREAM_IDLE_TIMEOUT;
+  blob.sensorPollInterval = SENSOR_POLL_INTERVAL;
+  blob.statsInterval = STATS_INTERVAL;
+  blob.historyInterval = HISTORY_INTERVAL;
+}
+
+// Falls back to the defaults if there's no settings file, or one from another firmware
+void loadSettings() {
+  File file = LittleFS.open(SETTINGS_FILE, "r");
+  if (file) {
+    bool valid = file.read((uint8_t *)&settings, sizeof(settings)) == sizeof(settings)
+      && settings.version == SETTINGS_VERSION
+      && settings.size == sizeof(settings)
+      && settings.checksum == settingsChecksum(settings);
+    file.close();
+    if (valid) {
+      return;
+    }
+    DLOG("Ignoring the settings in flash\n");
+  }
+  defaultSettings(settings);
+}
+
+void saveSettings() {
+  settings.checksum = settingsChecksum(settings);
+  File file = LittleFS.open(SETTINGS_FILE, "w");
+  if (!file) {
+    DLOG("Can't write %s\n", SETTINGS_FILE);
+    return;
+  }
+  file.write((const uint8_t *)&settings, sizeof(settings));
+  file.close();
+}
+
+// Publishes everything but the MQTT password
+void sendSettings() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(15) + JSON_ARRAY_SIZE(SETTINGS_SENSORS_MAX)> root;
+  root["mqtt_server"] = (const char *)settings.mqttServer;
+  root["mqtt_port"] = settings.mqttPort;
+  root["mqtt_user"] = (const char *)settings.mqttUser;
+  root["brc_pin"] = settings.brcPin;
+  root["model"] = (const char *)settings.model;
+  JsonArray sensorList = root.createNestedArray("sensors");
+  for (uint8_t i = 0; i < settings.sensorCount; i++) {
+    sensorList.add(settings.sensors[i]);
+  }
+  root["heartbeat_interval"] = settings.heartbeatInterval;
+  root["status_min_interval"] = settings.statusMinInterval;
+  root["current_delta"] = settings.currentDelta;
+  root["voltage_delta"] = settings.voltageDelta;
+  root["charge_delta"] = settings.chargeDelta;
+  root["stream_idle_timeout"] = settings.streamIdleTimeout;
+  root["sensor_poll_interval"] = settings.sensorPollInterval;
+  root["stats_interval"] = settings.statsInterval;
+  root["history_interval"] = settings.historyInterval;
+  publishJson(settingsTopic.name, root, MessageSettings);
+}
+
+bool readSettingString(JsonObject root, const char *key, char *dest, size_t size) {
+  if (root[key].isNull()) {
+    return true;
+  }
+  const char *value = root[key];
+  if (!value || strlen(value) >= size) {
+    return false;
+  }
+  strcpy(dest, value);
+  return true;
+}
+
+// True if value is a whole number from low to high
+bool settingInRange(JsonVariant value, double low, double high) {
+  if (!value.is<double>()) {
+    return false;
+  }
+  double number = value.as<double>();
+  return number >= low && number <= high && number == floor(number);
+}
+
+template<typename T>
+bool readSettingNumber(JsonObject root, const char *key, T &dest, double low, double high) {
+  if (root[key].isNull()) {
+    return true;
+  }
+  if (!settingInRange(root[key], low, high)) {
+    return false;
+  }
+  dest = (T)root[key].as<double>();
+  return true;
+}
+
+// GPIO 1 and 3 are the serial port to the Roomba, and 6 to 11 are wired to the flash
+bool brcPinUsable(uint8_t pin) {
+  return pin <= 16 && pin != 1 && pin != 3 && (pin < 6 || pin > 11);
+}
+
+// The new sensor list must be known to the decoder, and a poll of it must fit sensorPollData
+bool readSettingSensors(JsonObject root, Settings &blob) {
+  JsonArray list = root["sensors"];
+  if (list.isNull()) {
+    return true;
+  }
+  if (list.size() == 0 || list.size() > SETTINGS_SENSORS_MAX) {
+    return false;
+  }
+  for (size_t i = 0; i < list.size(); i++) {
+    if (!settingInRange(list[i], 0, 255)) {
+      return false;
+    }
+    uint8_t packetID = list[i].as<double>();
+    if (!Roomba::sensorField(packetID)) {
+      return false;
+    }
+    blob.sensors[i] = packetID;
+  }
+  blob.sensorCount = list.size();
+  return Roomba::sensorsDataSize(blob.sensors, blob.sensorCount) <= sizeof(robots[0].sensorPollData);
 }
 
-char* getMQTTTopic(const char* topic) {
-  // build mqtt target topic
-  static char mqttTopic[200];
-  sprintf(mqttTopic, "%s%s%s%s", MQTT_TOPIC_BASE, getEntityID(), MQTT_DIVIDER, topic);
-  return mqttTopic;
-}
+// The payload isn't writable, so deserializeJson() copies every key and string out of it
+const size_t settingsStringsSize = sizeof("mqtt_server") + sizeof("mqtt_port") + sizeof("mqtt_user")
+  + sizeof("mqtt_password") + sizeof("brc_pin") + sizeof("model") + sizeof("sensors")
+  + sizeof("heartbeat_interval") + sizeof("status_min_interval") + sizeof("current_delta")
+  + sizeof("voltage_delta") + sizeof("charge_delta") + sizeof("stream_idle_timeout")
+  + sizeof("sensor_poll_interval") + sizeof("stats_interval") + sizeof("history_interval")
+  + sizeof(Settings::mqttServer) + sizeof(Settings::mqttUser) + sizeof(Settings::mqttPassword)
+  + sizeof(Settings::model);
 
-void mqttCallback(char *topic, byte *payload, unsigned int length) {
-  DLOG("Received mqtt callback for topic %s\n", topic);
-  if (strcmp(getMQTTTopic(commandTopic), topic) == 0) {
-    // turn payload into a null terminated string
-    char *cmd = (char *)malloc(length + 1);
-    memcpy(cmd, payload, length);
-    cmd[length] = 0;
+// Changes the settings that are in payload, a JSON object with the keys of sendSettings()
+// and mqtt_password. Nothing changes if any of them has the wrong type or is out of range.
+// The set topic is meant to be retained, so it's received on every connect, and flash is
+// only written when something actually changed.
+void setSettings(const byte *payload, unsigned int length) {
+  StaticJsonDocument<JSON_OBJECT_SIZE(16) + JSON_ARRAY_SIZE(SETTINGS_SENSORS_MAX) + settingsStringsSize> root;
+  DeserializationError error = deserializeJson(root, payload, length);
+  if (error) {
+    DLOG("Bad settings: %s\n", error.c_str());
+    return;
+  }
+  JsonObject object = root.as<JsonObject>();
+  Settings blob = settings;
+  if (object.isNull()
+      || !readSettingString(object, "mqtt_server", blob.mqttServer, sizeof(blob.mqttServer))
+      || !readSettingString(object, "mqtt_user", blob.mqttUser, sizeof(blob.mqttUser))
+      || !readSettingString(object, "mqtt_password", blob.mqttPassword, sizeof(blob.mqttPassword))
+      || !readSettingString(object, "model", blob.model, sizeof(blob.model))
+      || !readSettingSensors(object, blob)
+      || !readSettingNumber(object, "mqtt_port", blob.mqttPort, 1, 65535)
+      || !readSettingNumber(object, "brc_pin", blob.brcPin, 0, 16)
+      || !brcPinUsable(blob.brcPin)
+      || !readSettingNumber(object, "heartbeat_interval", blob.heartbeatInterval, 1000, SETTINGS_INTERVAL_MAX)
+      || !readSettingNumber(object, "status_min_interval", blob.statusMinInterval, 100, SETTINGS_INTERVAL_MAX)
+      || !readSettingNumber(object, "current_delta", blob.currentDelta, 0, 65535)
+      || !readSettingNumber(object, "voltage_delta", blob.voltageDelta, 0, 65535)
+      || !readSettingNumber(object, "charge_delta", blob.chargeDelta, 0, 65535)
+      || !readSettingNumber(object, "stream_idle_timeout", blob.streamIdleTimeout, 1000, SETTINGS_INTERVAL_MAX)
+      || !readSettingNumber(object, "sensor_poll_interval", blob.sensorPollInterval, 100, SETTINGS_INTERVAL_MAX)
+      || !readSettingNumber(object, "stats_interval", blob.statsInterval, 1000, SETTINGS_INTERVAL_MAX)
+      || !readSettingNumber(object, "history_interval", blob.historyInterval, 0, SETTINGS_INTERVAL_MAX)
+      || (blob.historyInterval && blob.historyInterval < 100)) { // 0 records every stream frame
+    DLOG("Bad settings, nothing changed\n");
+    return;
+  }
+  blob.checksum = settings.checksum;
+  if (memcmp(&blob, &settings, sizeof(blob)) == 0) {
+    return;
+  }
 
-    if(!performCommand(cmd)) {
-      DLOG("Unknown command %s\n", cmd);
+  bool restart = strcmp(blob.mqttServer, settings.mqttServer) != 0
+    || blob.mqttPort != settings.mqttPort
+    || strcmp(blob.mqttUser, settings.mqttUser) != 0
+    || strcmp(blob.mqttPassword, settings.mqttPassword) != 0
+    || blob.brcPin != settings.brcPin;
+  bool sensorsChanged = blob.sensorCount != settings.sensorCount
+    || memcmp(blob.sensors, settings.sensors, blob.sensorCount) != 0;
+  bool modelChanged = strcmp(blob.model, settings.model) != 0;
+  settings = blob;
+  saveSettings();
+  sendSettings();
+  DLOG("Settings changed%s\n", restart ? ", restarting" : "");
+  if (restart) {
+    restartPending = true;
+    return;
+  }
+  if (sensorsChanged) {
+    for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+      Robot &robot = robots[i];
+      // A pending poll would be decoded against the new list
+      if (robot.sensorPollHandle) {
+        robot.roomba.cancelRequest();
+        robot.sensorPollHandle = 0;
+      }
+      if (robot.sensorMode == SensorModeStream) {
+        requestStream(robot);
+      }
     }
-    free(cmd);
   }
-}
-
-float readADC(int samples) {
-  // Basic code to read from the ADC
-  int adc = 0;
-  for (int i = 0; i < samples; i++) {
-    delay(1);
-    adc += analogRead(A0);
+  if (modelChanged || sensorsChanged) {
+    buildConfigs();
   }
-  adc = adc / samples;
-  float mV = adc * ADC_VOLTAGE_DIVIDER;
-  VLOG("ADC for %d is %.1fmV with %d samples\n", adc, mV, samples);
-  return mV;
 }
 
-void setDateTime() {
-  configTime(0, 0, NTP_SERVER_1, NTP_SERVER_2);
-  time_t now = time(nullptr);
-  while (now < 8 * 3600 * 2) {
-    delay(500);
-    now = time(nullptr);
+void mqttCallback(char *topic, byte *payload, unsigned int length) {
+  DLOG("Received mqtt callback for topic %s\n", topic);
+  uint16_t topicLength;
+  uint32_t topicHash = hashTopic(topic, &topicLength);
+  if (topicMatches(settingsSetTopic, topic, topicLength, topicHash)) {
+    setSettings(payload, length);
+    return;
+  }
+  if (topicMatches(discoveryStatusTopic, topic, topicLength, topicHash)) {
+    // Home Assistant restarted and may have lost the retained configs
+    if (length == 6 && memcmp(payload, "online", 6) == 0) {
+      DLOG("Home Assistant online, sending discovery configs\n");
+      for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+        robots[i].config.sentHash = 0;
+      }
+    }
+    return;
+  }
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    if (topicMatches(robots[i].commandTopic, topic, topicLength, topicHash)) {
+      if (!performCommand(robots[i], (const char *)payload, length)) {
+        DLOG("Unknown command %.*s\n", (int)length, (const char *)payload);
+      }
+      return;
+    }
+    if (topicMatches(robots[i].scheduleSetTopic, topic, topicLength, topicHash)) {
+      setSchedule(robots[i], payload, length);
+      return;
+    }
   }
-  time_t local = tz.toLocal(now);
-  roomba.setDayTime(dayOfWeek(local)-1, hour(local), minute(local));
 }
 
 void debugCallback() {
   String cmd = Debug.getLastCommand();
+  const char *name = cmd.c_str();
+  size_t length = cmd.length();
 
-  // Debugging commands via telnet
-  if (performCommand(cmd.c_str())) {
-  } else if (cmd == "quit") {
-    DLOG("Stopping Roomba\n");
-    Serial.write(173);
-  } else if (cmd == "rreset") {
-    DLOG("Resetting Roomba\n");
-    roomba.reset();
-  } else if (cmd == "mqtthello") {
-    mqttClient.publish("vacuum/hello", "hello there");
-  } else if (cmd == "version") {
-    const char compile_date[] = __DATE__ " " __TIME__;
-    DLOG("Compiled on: %s\n", compile_date);
-  } else if (cmd == "baud115200") {
-    DLOG("Setting baud to 115200\n");
-    Serial.begin(115200);
-    delay(100);
-  } else if (cmd == "baud19200") {
-    DLOG("Setting baud to 19200\n");
-    Serial.begin(19200);
-    delay(100);
-  } else if (cmd == "baud57600") {
-    DLOG("Setting baud to 57600\n");
-    Serial.begin(57600);
-    delay(100);
-  } else if (cmd == "baud38400") {
-    DLOG("Setting baud to 38400\n");
-    Serial.begin(38400);
-    delay(100);
-  } else if (cmd == "sleep5") {
-    DLOG("Going to sleep for 5 seconds\n");
-    delay(100);
-    ESP.deepSleep(5e6);
-  } else if (cmd == "wake") {
-    DLOG("Toggle BRC pin\n");
-    wakeup();
-  } else if (cmd == "readadc") {
-    float adc = readADC(10);
-    DLOG("ADC voltage is %.1fmV\n", adc);
-  } else if (cmd == "streamresume") {
-    DLOG("Resume streaming\n");
-    roomba.streamCommand(Roomba::StreamCommandResume);
-  } else if (cmd == "streampause") {
-    DLOG("Pause streaming\n");
-    roomba.streamCommand(Roomba::StreamCommandPause);
-  } else if (cmd == "stream") {
-    DLOG("Requesting stream\n");
-    roomba.stream(sensors, sizeof(sensors));
-  } else if (cmd == "streamreset") {
-    DLOG("Resetting stream\n");
-    roomba.stream({}, 0);
-  } else if (cmd == "time") {
-    setDateTime();
-  } else {
-    DLOG("Unknown command %s\n", cmd.c_str());
+  // In gateway mode, commands for another Roomba start with its number, e.g. "1 locate"
+  uint8_t index = 0;
+  if (length > 2 && name[0] >= '0' && name[0] <= '9' && name[1] == ' ') {
+    index = name[0] - '0';
+    name += 2;
+    length -= 2;
+  }
+  if (index >= ROBOT_COUNT) {
+    DLOG("No Roomba %d\n", index);
+    return;
+  }
+
+  // Debugging commands via telnet, including all the MQTT ones
+  if (!runCommand(robots[index], name, length, 0)) {
+    DLOG("Unknown command %s\n", name);
   }
 }
 
 void sleepIfNecessary() {
 #ifdef ENABLE_ADC_SLEEP
   // Check the battery, if it's too low, sleep the ESP (so we don't murder the battery)
-  float mV = readADC(10);
+  float mV = adc.voltage;
   // According to this post, you want to stop using NiMH batteries at about 0.9V per cell
   // https://electronics.stackexchange.com/a/35879 For a 12 cell battery like is in the Roomba,
   // That's 10.8 volts.
@@ -293,10 +2390,10 @@ void sleepIfNecessary() {
       root["charging"] = false;
       root["voltage"] = mV / 1000;
       root["charge"] = 0;
-      String jsonStr;
-      serializeJson(root, jsonStr);
-      mqttClient.publish(getMQTTTopic(stateTopic), jsonStr.c_str(), true);
+      publishJson(robots[0].stateTopic.name, root, MessageState);
+      flushPublishQueue();
     }
+    flushLog();
     delay(200);
 
     // Sleep for 10 minutes
@@ -305,287 +2402,832 @@ void sleepIfNecessary() {
 #endif
 }
 
-bool parseRoombaStateFromStreamPacket(uint8_t *packet, int length, RoombaState *state) {
-  state->timestamp = millis();
-  int i = 0;
-  while (i < length) {
-    switch(packet[i]) {
-      case Roomba::Sensors7to26: // 0
-        i += 27;
-        break;
-      case Roomba::Sensors7to16: // 1
-        i += 11;
-        break;
-      case Roomba::SensorVirtualWall: // 13
-        i += 2;
-        break;
-      case Roomba::SensorDistance: // 19
-        state->distance = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorChargingState: // 21
-        state->chargingState = packet[i+1];
-        i += 2;
-        break;
-      case Roomba::SensorVoltage: // 22
-        state->voltage = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorCurrent: // 23
-        state->current = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorBatteryCharge: // 25
-        state->charge = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorBatteryCapacity: //26
-        state->capacity = packet[i+1] * 256 + packet[i+2];
-        i += 3;
-        break;
-      case Roomba::SensorBumpsAndWheelDrops: // 7
-        i += 2;
-        break;
-      case 128: // Unknown
-        i += 2;
-        break;
-      default:
-        VLOG("Unhandled Packet ID %d\n", packet[i]);
-        return false;
-        break;
-    }
+void readSensorPacket(Robot &robot) {
+  RoombaState &state = robot.state;
+  if (robot.roomba.pollSensors(&state)) {
+    VLOG("Got Packet! Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", state.distance, state.chargingState, state.voltage, state.current, state.charge, state.capacity);
+    updateRoombaState(state);
+    updateBattery(robot);
+    updateEvents(robot);
+    recordHistory(robot);
+    updateSession(robot);
+  }
+}
+
+void onOTAStart() {
+  DLOG("Starting OTA session\n");
+  DLOG("Pause streaming\n");
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    robots[i].roomba.streamCommand(Roomba::StreamCommandPause);
+  }
+  OTAStarted = true;
+}
+
+// Sets up the serial port and BRC pin of each Roomba
+void setupRobots() {
+  robots[0].roomba = Roomba(&Serial, Roomba::Baud115200);
+  robots[0].brcPin = settings.brcPin;
+#ifdef GATEWAY_ROBOTS
+  for (uint8_t i = 1; i < ROBOT_COUNT; i++) {
+    const GatewayRobot &pins = gatewayRobots[i - 1];
+    SoftwareSerial *serial = new SoftwareSerial(pins.rxPin, pins.txPin);
+    robots[i].roomba = Roomba(serial, GATEWAY_BAUD);
+    serial->begin(robots[i].roomba.baudCodeToBaudRate(GATEWAY_BAUD));
+    robots[i].brcPin = pins.brcPin;
+  }
+#endif
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    robot.index = i;
+    // High-impedence on the BRC pin
+    pinMode(robot.brcPin,INPUT);
+  }
+}
+
+// Starts a Roomba's sensor stream. The Roomba needs a moment after Start before it
+// takes the stream commands, so they're queued rather than sent with it
+void startRobot(Robot &robot) {
+  robot.roomba.setRxBufferSize(ROOMBA_RX_BUFFER_SIZE);
+  robot.roomba.start();
+  queueStep(robot, 100, CommandStepStream);
+}
+
+// FNV-1a of everything before the checksum
+uint32_t rtcChecksum(const RtcState &state) {
+  const uint8_t *p = (const uint8_t *)&state;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(state) - sizeof(state.checksum); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Picks up the state saved by dutyCycleSleep(), returns false after a normal start
+bool restoreRtcState() {
+#ifdef DUTY_CYCLE
+  if (ESP.getResetInfoPtr()->reason != REASON_DEEP_SLEEP_AWAKE
+      || !ESP.rtcUserMemoryRead(0, (uint32_t *)&rtcState, sizeof(rtcState))
+      || rtcState.magic != RTC_STATE_MAGIC
+      || rtcState.checksum != rtcChecksum(rtcState)) {
+    memset(&rtcState, 0, sizeof(rtcState));
+    return false;
+  }
+  rtcState.wakeups++;
+  loopStats.publishes = rtcState.publishes;
+  loopStats.reconnects = rtcState.reconnects;
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    robot.lastSentState = rtcState.robots[i].lastSentState;
+    robot.state = robot.lastSentState;
+    robot.state.timestamp = 0; // Nothing read yet
+    robot.state.sent = true; // Already published before the sleep, wait for a fresh reading
+    robot.lastStateMsgTime = -(long)rtcState.robots[i].sincePublish;
+    robot.songSlots = rtcState.robots[i].songSlots;
+    robot.config.sentHash = rtcState.robots[i].configHash;
+  }
+  // The clock carries on from where the sleep should have ended, plus the time
+  // spent booting. The sleep timer still drifts, so NTP corrects it now and then.
+  if (rtcState.wakeEpoch) {
+    uint64_t wake = rtcState.wakeEpoch * 1000ULL + rtcState.wakeMillis + millis();
+    timeval tv = {(time_t)(wake / 1000), (suseconds_t)(wake % 1000 * 1000)};
+    settimeofday(&tv, NULL);
   }
   return true;
+#else
+  return false;
+#endif
 }
 
-void verboseLogPacket(uint8_t *packet, uint8_t length) {
-    VLOG("Packet: ");
-    for (int i = 0; i < length; i++) {
-      VLOG("%d ", packet[i]);
-    }
-    VLOG("\n");
-}
-
-void readSensorPacket() {
-  uint8_t packetLength;
-  bool received = roomba.pollSensors(roombaPacket, sizeof(roombaPacket), &packetLength);
-  if (received) {
-    RoombaState rs = {};
-    bool parsed = parseRoombaStateFromStreamPacket(roombaPacket, packetLength, &rs);
-    verboseLogPacket(roombaPacket, packetLength);
-    if (parsed) {
-      roombaState = rs;
-      VLOG("Got Packet of len=%d! Distance:%dmm ChargingState:%d Voltage:%dmV Current:%dmA Charge:%dmAh Capacity:%dmAh\n", packetLength, roombaState.distance, roombaState.chargingState, roombaState.voltage, roombaState.current, roombaState.charge, roombaState.capacity);
-      roombaState.cleaning = false;
-      roombaState.docked = false;
-      if (roombaState.current < -400) {
-        roombaState.cleaning = true;
-      } else if (roombaState.current > -50) {
-        roombaState.docked = true;
+// Saves what the next wakeup needs, reports how long this one took and sleeps
+void dutyCycleSleep() {
+  unsigned long now = millis();
+  // Wake up a little before the next scheduled job
+  uint32_t sleepTime = DUTY_CYCLE_SLEEP;
+  rtcState.wakeEpoch = 0;
+  rtcState.wakeMillis = 0;
+  if (timeKnown()) {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    time_t epoch = tv.tv_sec;
+    for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+      time_t nextFire = robots[i].schedule.nextFire;
+      int64_t untilJob = (int64_t)(nextFire - epoch) * 1000 - DUTY_CYCLE_WAKE_EARLY;
+      if (nextFire && untilJob < sleepTime) {
+        sleepTime = max(untilJob, (int64_t)0);
       }
-    } else {
-      VLOG("Failed to parse packet\n");
     }
+    sleepTime = max(sleepTime, (uint32_t)1000); // 0 would sleep for good
+    // To the ms, or the dropped fractions add up over the wakeups
+    uint64_t wake = epoch * 1000ULL + tv.tv_usec / 1000 + sleepTime;
+    rtcState.wakeEpoch = wake / 1000;
+    rtcState.wakeMillis = wake % 1000;
   }
-}
+  DLOG("Sleeping for %ds after %lums awake\n", sleepTime / 1000, now);
+  rtcState.awakeTime = now;
+  sendStats();
 
-void onOTAStart() {
-  DLOG("Starting OTA session\n");
-  DLOG("Pause streaming\n");
-  roomba.streamCommand(Roomba::StreamCommandPause);
-  OTAStarted = true;
+  rtcState.magic = RTC_STATE_MAGIC;
+  rtcState.publishes = loopStats.publishes;
+  rtcState.reconnects = loopStats.reconnects;
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    // Don't leave the Roomba streaming to nobody
+    robot.roomba.streamCommand(Roomba::StreamCommandPause);
+    rtcState.robots[i].songSlots = robot.songSlots;
+    rtcState.robots[i].configHash = robot.config.sentHash;
+    rtcState.robots[i].lastSentState = robot.lastSentState;
+    rtcState.robots[i].sincePublish = now - robot.lastStateMsgTime + sleepTime;
+  }
+  rtcState.checksum = rtcChecksum(rtcState);
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&rtcState, sizeof(rtcState));
+
+  // Give the last publishes time to go out
+  flushPublishQueue();
+  flushLog();
+  delay(100);
+  ESP.deepSleep(sleepTime * 1000ULL);
 }
 
-void setup() {
-  // High-impedence on the BRC_PIN
-  pinMode(BRC_PIN,INPUT);
+// After a duty cycle wakeup the Roomba is only polled, never streamed
+void startRobotPolling(Robot &robot) {
+  robot.roomba.setRxBufferSize(ROOMBA_RX_BUFFER_SIZE);
+  robot.roomba.start();
+  wakeup(robot);
+  robot.sensorMode = SensorModePoll;
+  robot.lastSensorPollTime = millis() - settings.sensorPollInterval; // Poll as soon as it's awake
+}
 
-  // Sleep immediately if ENABLE_ADC_SLEEP and the battery is low
-  sleepIfNecessary();
+// Sleeps once every Roomba has been docked and idle for DUTY_CYCLE_IDLE_TIMEOUT,
+// or after a wakeup as soon as they have all been polled and reported
+void updateDutyCycle() {
+#ifdef DUTY_CYCLE
+  unsigned long now = millis();
+  bool sampled = true;
+  bool idle = true;
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    const Robot &robot = robots[i];
+    if (!robot.state.timestamp) {
+      sampled = false;
+    } else if (!robot.state.docked || robot.state.cleaning) {
+      idle = false;
+    }
+    if (robot.commandQueueCount || robot.history.flushing) {
+      idle = false;
+    }
+  }
+  if (dutyCycleWake) {
+    // Give NTP a moment to correct the clock, but don't stay up for it
+    bool syncing = timeSyncPending && now - timeSyncStartTime < DUTY_CYCLE_NTP_TIMEOUT;
+    if (!sampled || !mqttClient.connected() || syncing) {
+      if (now > DUTY_CYCLE_AWAKE_TIMEOUT) {
+        dutyCycleSleep();
+      }
+    } else if (idle) {
+      dutyCycleSleep();
+    } else {
+      DLOG("Roomba busy, staying awake\n");
+      dutyCycleWake = false;
+      dockedIdleTime = now;
+      for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+        requestStream(robots[i]);
+      }
+    }
+    return;
+  }
+  if (!sampled || !idle || OTAStarted || !mqttClient.connected()) {
+    dockedIdleTime = now;
+  } else if (now - dockedIdleTime > DUTY_CYCLE_IDLE_TIMEOUT) {
+    dutyCycleSleep();
+  }
+#endif
+}
 
-  // Set Hostname.
-  String hostname(HOSTNAME);
-  WiFi.hostname(hostname);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
+long heartbeatInterval() {
+#ifdef DUTY_CYCLE
+  if (dutyCycleWake) {
+    return DUTY_CYCLE_HEARTBEAT;
   }
+#endif
+  return settings.heartbeatInterval;
+}
+
+// Startup runs in stages from loop(), so the sensor stream starts straight away
+// and a missing access point or NTP server can't hang the ESP. Waits have
+// timeouts, after which they're retried.
+typedef enum {
+  StartupConnecting = 0, // Waiting for WiFi
+  StartupConnected  = 1, // OTA, telnet and MQTT are up
+} StartupStage;
+
+uint8_t startupStage = StartupConnecting;
 
-  ArduinoOTA.setHostname((const char *)hostname.c_str());
+// Brings up what needs the network once WiFi is connected
+void startNetworkServices() {
+  DLOG("WiFi connected in %lums\n", millis());
+  ArduinoOTA.setHostname(HOSTNAME);
   ArduinoOTA.begin();
   ArduinoOTA.onStart(onOTAStart);
 
-  mqttClient.setServer(MQTT_SERVER, MQTT_PORT);
-  mqttClient.setCallback(mqttCallback);
-
   #if LOGGING
-  Debug.begin((const char *)hostname.c_str());
+  Debug.begin(HOSTNAME);
   Debug.setResetCmdEnabled(true);
   Debug.setCallBackProjectCmds(debugCallback);
   Debug.setSerialEnabled(false);
   #endif
 
-  // Learn locate song
-  roomba.safeMode();
-  byte locateSong0[18] = {55, 32, 55, 32, 55, 32, 51, 24, 58, 8, 55, 32, 51, 24, 58, 8, 55, 64};
-  byte locateSong1[18] = {62, 32, 62, 32, 62, 32, 63, 24, 58, 8, 54, 32, 51, 24, 58, 8, 55, 64};
-  byte locateSong2[24] = {67, 32, 55, 24, 55, 8, 67, 32, 66, 24, 65, 8, 64, 8, 63, 8, 64, 16, 30, 16, 56, 16, 61, 32};
-  byte locateSong3[28] = {60, 24, 59, 8, 58, 8, 57, 8, 58, 16, 10, 16, 52, 16, 54, 32, 51, 24, 58, 8, 55, 32, 51, 24, 58, 8, 55, 64};
-  roomba.song(0, locateSong0, 18);
-  roomba.song(1, locateSong1, 18);
-  roomba.song(2, locateSong2, 24);
-  roomba.song(3, locateSong3, 28);
-
-  roomba.start();
-  delay(100);
-  // Reset stream sensor values
-  roomba.stream({}, 0);
-  delay(100);
-  // Request sensor stream
-  roomba.stream(sensors, sizeof(sensors));
-
   #ifdef SET_DATETIME
-  wakeup();
-  // set time
-  setDateTime();
+  // Wakeups carry the clock on through the sleep, so they only ask NTP every
+  // DUTY_CYCLE_NTP_WAKEUPS to take out the sleep timer's drift
+  if (!dutyCycleWake || !timeKnown() || rtcState.wakeups % DUTY_CYCLE_NTP_WAKEUPS == 0) {
+    startTimeSync();
+  }
   #endif
 }
 
-void reconnect() {
-  DLOG("Attempting MQTT connection...\n");
-  // Attempt to connect
-  if (mqttClient.connect(HOSTNAME, MQTT_USER, MQTT_PASSWORD)) {
-    DLOG("MQTT connected\n");
-    mqttClient.subscribe(getMQTTTopic(commandTopic));
+void updateStartup() {
+  if (startupStage == StartupConnecting && wifiLink.up) {
+    startNetworkServices();
+    startupStage = StartupConnected;
+  }
+  updateTimeSync();
+}
+
+void setup() {
+  LittleFS.begin();
+  loadSettings();
+
+  setupRobots();
+  setupTopics();
+  setupEntityTopics();
+  buildConfigs();
+  resetLoopStats();
+
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    loadSchedule(robots[i]);
+  }
+
+  // Sleep immediately if ENABLE_ADC_SLEEP and the battery is low
+  seedADC();
+  sleepIfNecessary();
+
+  dutyCycleWake = restoreRtcState();
+  // The clock now reads where the sleep should have ended, which may be
+  // right on the job it was cut short for, so plan from just before
+  planSchedules(dutyCycleWake ? time(nullptr) - 1 : 0);
+  if (!dutyCycleWake) {
+    // Retained, so it only goes out after a normal start
+    sendSettings();
+    for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+      sendSchedule(robots[i]);
+    }
+  }
+
+  // Sensors first, everything else is brought up by updateStartup()
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    if (dutyCycleWake) {
+      startRobotPolling(robots[i]);
+    } else {
+      startRobot(robots[i]);
+    }
+  }
+
+  WiFi.hostname(HOSTNAME);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  backOff(wifiLink, WIFI_CONNECT_TIMEOUT, WIFI_BACKOFF_MAX);
+
+  // Bound how long a connect attempt can hold up loop()
+  wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT);
+  mqttClient.setSocketTimeout(MQTT_CONNECT_TIMEOUT / 1000);
+  mqttClient.setCallback(mqttCallback);
+}
+
+// Sensor entities. Each decoded value in the table is also its own Home
+// Assistant sensor, with a retained state topic that carries just the number,
+// so consumers don't have to parse or re-render the whole state on every
+// change. An entity only exists while its packet is in the sensor list. The
+// values read straight from the decoded fields through Roomba::sensorField(),
+// and are published at most every status_min_interval, only those that
+// changed by at least their delta.
+typedef struct {
+  const char *id; // Ends the unique ID and the state topic
+  const char *name;
+  uint8_t packetID; // One of Roomba::Sensor
+  uint8_t mask; // For a binary sensor the bits that turn it on, else 0
+  uint8_t delta; // Smallest change worth publishing
+  const char *deviceClass; // NULL if none
+  const char *unit; // NULL if none
+} SensorEntity;
+
+const SensorEntity sensorEntities[SENSOR_ENTITIES] = {
+  {"voltage", "Voltage", Roomba::SensorVoltage, 0, 50, "voltage", "mV"},
+  {"current", "Current", Roomba::SensorCurrent, 0, 20, "current", "mA"},
+  {"charge", "Charge", Roomba::SensorBatteryCharge, 0, 5, NULL, "mAh"},
+  {"capacity", "Capacity", Roomba::SensorBatteryCapacity, 0, 1, NULL, "mAh"},
+  {"battery_temperature", "Battery temperature", Roomba::SensorBatteryTemperature, 0, 1, "temperature", "\xc2\xb0" "C"},
+  {"charging_state", "Charging state", Roomba::SensorChargingState, 0, 1, NULL, NULL},
+  {"bump_left", "Bump left", Roomba::SensorBumpsAndWheelDrops, ROOMBA_MASK_BUMP_LEFT, 1, NULL, NULL},
+  {"bump_right", "Bump right", Roomba::SensorBumpsAndWheelDrops, ROOMBA_MASK_BUMP_RIGHT, 1, NULL, NULL},
+  {"wheel_drop", "Wheel drop", Roomba::SensorBumpsAndWheelDrops,
+    ROOMBA_MASK_WHEELDROP_LEFT | ROOMBA_MASK_WHEELDROP_RIGHT | ROOMBA_MASK_WHEELDROP_CASTER, 1, "problem", NULL},
+  {"cliff_left", "Cliff left", Roomba::SensorCliffLeft, 1, 1, "problem", NULL},
+  {"cliff_front_left", "Cliff front left", Roomba::SensorCliffFrontLeft, 1, 1, "problem", NULL},
+  {"cliff_front_right", "Cliff front right", Roomba::SensorCliffFrontRight, 1, 1, "problem", NULL},
+  {"cliff_right", "Cliff right", Roomba::SensorCliffRight, 1, 1, "problem", NULL},
+  {"wall", "Wall", Roomba::SensorWall, 1, 1, NULL, NULL},
+  {"virtual_wall", "Virtual wall", Roomba::SensorVirtualWall, 1, 1, NULL, NULL},
+};
+
+static_assert(SENSOR_ENTITIES <= 32, "entity flags are a 32 bit mask");
+
+void setupEntityTopics() {
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    for (uint8_t j = 0; j < SENSOR_ENTITIES; j++) {
+      char suffix[40];
+      snprintf(suffix, sizeof(suffix), "%s%s%s", MQTT_SENSOR_TOPIC, MQTT_DIVIDER, sensorEntities[j].id);
+      setMQTTTopic(&robot.entityTopics[j], robot.baseTopic, suffix);
+    }
+  }
+}
+
+// Whether the sensor list decodes packetID, by itself or as part of a group
+bool sensorListed(uint8_t packetID) {
+  for (uint8_t i = 0; i < settings.sensorCount; i++) {
+    uint8_t id = settings.sensors[i];
+    if (id == packetID) {
+      return true;
+    }
+    const Roomba::SensorField *field = Roomba::sensorField(id);
+    if (!field || !(field->flags & Roomba::SensorFieldGroup)) {
+      continue;
+    }
+    // Members are the consecutive packet IDs that make up the size of the group
+    uint8_t size = 0;
+    for (uint8_t member = field->field; size < field->size; member++) {
+      const Roomba::SensorField *memberField = Roomba::sensorField(member);
+      if (!memberField) {
+        break;
+      }
+      if (member == packetID) {
+        return true;
+      }
+      size += memberField->size;
+    }
+  }
+  return false;
+}
+
+int32_t entityValue(const RoombaState &state, const SensorEntity &entity) {
+  const Roomba::SensorField *field = Roomba::sensorField(entity.packetID);
+  const uint8_t *p = (const uint8_t *)static_cast<const Roomba::SensorValues *>(&state) + field->field;
+  bool isSigned = field->flags & Roomba::SensorFieldSigned;
+  int32_t value;
+  if (field->size == 1) {
+    value = isSigned ? (int8_t)*p : *p;
+  } else {
+    uint16_t raw;
+    memcpy(&raw, p, sizeof(raw));
+    value = isSigned ? (int16_t)raw : raw;
+  }
+  if (entity.mask) {
+    value = (value & entity.mask) != 0;
+  }
+  return value;
+}
+
+// Publishes the config of the next entity that needs one, one at a time since
+// they share entityConfigTopic. Entities missing from the sensor list get an
+// empty config, which removes them from Home Assistant.
+void updateEntityConfigs(Robot &robot) {
+  if (!robot.entityConfigsDue || publishPending(robot.entityConfigTopic)
+      || publishQueueCount() >= MQTT_QUEUE_SLOTS / 2) {
+    return;
+  }
+  uint8_t i = 0;
+  while (!(robot.entityConfigsDue & (1ul << i))) {
+    i++;
+  }
+  const SensorEntity &entity = sensorEntities[i];
+  const char *component = entity.mask ? "binary_sensor" : "sensor";
+  snprintf(robot.entityConfigTopic, sizeof(robot.entityConfigTopic), "%s%s%s%s%s%s%s%s%s", MQTT_DISCOVERY, MQTT_DIVIDER,
+    component, MQTT_DIVIDER, robot.entityID, MQTT_DIVIDER, entity.id, MQTT_DIVIDER, MQTT_CONFIG_TOPIC);
+  bool sent;
+  if (!sensorListed(entity.packetID)) {
+    sent = publishPayload(robot.entityConfigTopic, NULL, 0, MessageConfig);
   } else {
-    DLOG("MQTT failed rc=%d try again in 5 seconds\n", mqttClient.state());
+    char uniqueID[60];
+    snprintf(uniqueID, sizeof(uniqueID), "%s_%s", robot.entityID, entity.id);
+    StaticJsonDocument<JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(1)> root;
+    root["name"] = entity.name;
+    root["uniq_id"] = (const char *)uniqueID;
+    root["stat_t"] = (const char *)robot.entityTopics[i].name;
+    if (entity.mask) {
+      root["pl_on"] = "1";
+      root["pl_off"] = "0";
+    } else {
+      root["stat_cla"] = "measurement";
+    }
+    if (entity.deviceClass) {
+      root["dev_cla"] = entity.deviceClass;
+    }
+    if (entity.unit) {
+      root["unit_of_meas"] = entity.unit;
+    }
+    root["dev"]["ids"][0] = (const char *)robot.entityID;
+    if (root.overflowed() || !fitsPacket(robot.entityConfigTopic, measureJson(root))) {
+      // It won't get any shorter by trying again
+      DLOG("Config for %s too long, skipping it\n", entity.id);
+      robot.entityConfigsDue &= ~(1ul << i);
+      return;
+    }
+    sent = publishJson(robot.entityConfigTopic, root, MessageConfig);
+  }
+  if (sent) {
+    robot.entityConfigsDue &= ~(1ul << i);
   }
 }
 
-void sendConfig() {
-  if (!mqttClient.connected()) {
-    DLOG("MQTT Disconnected, not sending config\n");
+// Publishes the values of the entities that changed. Leaves half the queue to
+// everything else, whatever doesn't fit goes out next time.
+void updateEntities(Robot &robot) {
+  unsigned long now = millis();
+  if (!mqttLink.up || !robot.state.timestamp || now - robot.lastEntityTime < settings.statusMinInterval) {
     return;
   }
+  robot.lastEntityTime = now;
+  for (uint8_t i = 0; i < SENSOR_ENTITIES; i++) {
+    const SensorEntity &entity = sensorEntities[i];
+    if (!sensorListed(entity.packetID)) {
+      continue;
+    }
+    int32_t value = entityValue(robot.state, entity);
+    uint32_t bit = 1ul << i;
+    if ((robot.entitiesSent & bit) && abs(value - robot.entityValues[i]) < entity.delta) {
+      continue;
+    }
+    if (publishQueueCount() >= MQTT_QUEUE_SLOTS / 2) {
+      return;
+    }
+    char payload[12];
+    int length = snprintf(payload, sizeof(payload), "%d", (int)value);
+    if (publishPayload(robot.entityTopics[i].name, (const uint8_t *)payload, length, MessageEntity)) {
+      robot.entityValues[i] = value;
+      robot.entitiesSent |= bit;
+    }
+  }
+}
+
+// Serializes the discovery config into the cache, with the abbreviated keys
+// Home Assistant accepts to keep it short
+void buildConfig(Robot &robot) {
   StaticJsonDocument<500> root;
-  root["name"] = String("Roomba ") + getMAC();
-  root["unique_id"] = getEntityID();
+  root["name"] = (const char *)robot.deviceName;
+  root["uniq_id"] = (const char *)robot.entityID;
   root["schema"] = "state";
-  char baseTopic[200];
-  sprintf(baseTopic, "%s%s", MQTT_TOPIC_BASE, getEntityID());
-  root["~"] = baseTopic;
-  root["stat_t"] = String("~/") + stateTopic;
-  root["cmd_t"] = String("~/") + commandTopic;
-  root["send_cmd_t"] = String("~/") + commandTopic;
-  root["json_attr_t"] = String("~/") + stateTopic;
+  root["~"] = (const char *)robot.baseTopic;
+  root["stat_t"] = "~/" MQTT_STATE_TOPIC;
+  root["cmd_t"] = "~/" MQTT_COMMAND_TOPIC;
+  root["send_cmd_t"] = "~/" MQTT_COMMAND_TOPIC;
+  root["json_attr_t"] = "~/" MQTT_STATE_TOPIC;
   root["sup_feat"][0] = "start";
   root["sup_feat"][1] = "stop";
   root["sup_feat"][2] = "pause";
   root["sup_feat"][3] = "return_home";
   root["sup_feat"][4] = "locate";
   root["sup_feat"][5] = "clean_spot";
-  root["dev"]["name"] = String("Roomba ") + getMAC();
-  root["dev"]["ids"][0] = getEntityID();
+  root["dev"]["name"] = (const char *)robot.deviceName;
+  root["dev"]["ids"][0] = (const char *)robot.entityID;
   root["dev"]["mf"] = "iRobot";
-  root["dev"]["mdl"] = ROOMBA_MODEL;
-  String jsonStr;
-  serializeJson(root, jsonStr);
-  DLOG("Reporting config: %s\n", jsonStr.c_str());
-  mqttClient.publish(getMQTTTopic(configTopic), jsonStr.c_str());
-}
-
-void sendStatus() {
-  if (!mqttClient.connected()) {
-    DLOG("MQTT Disconnected, not sending status\n");
-    return;
-  }
-  StaticJsonDocument<200> root;
-  root["battery_level"] = (roombaState.charge * 100)/roombaState.capacity;
-  root["cleaning"] = roombaState.cleaning;
-  root["docked"] = roombaState.docked;
-  root["charging"] = roombaState.chargingState == Roomba::ChargeStateReconditioningCharging
-  || roombaState.chargingState == Roomba::ChargeStateFullCharging
-  || roombaState.chargingState == Roomba::ChargeStateTrickleCharging;
-  root["voltage"] = roombaState.voltage;
-  root["current"] = roombaState.current;
-  root["charge"] = roombaState.charge;
-  String curState = "idle";
-  if (roombaState.docked) {
+  root["dev"]["mdl"] = (const char *)settings.model;
+  DiscoveryConfig &config = robot.config;
+  config.length = serializeJson(root, config.payload, sizeof(config.payload));
+  // Filling the buffer means it was cut short. Either way the broker would never
+  // get it, so it's logged once here rather than retried on every loop.
+  config.failed = root.overflowed() || config.length >= sizeof(config.payload) - 1
+    || !fitsPacket(robot.configTopic.name, config.length);
+  if (config.failed) {
+    DLOG("Discovery config for Roomba %d too long, not publishing it\n", robot.index);
+  }
+  config.hash = 2166136261u;
+  for (uint16_t i = 0; i < config.length; i++) {
+    config.hash = (config.hash ^ (uint8_t)config.payload[i]) * 16777619u;
+  }
+  // The sensor list decides which entities there are, so it counts too
+  for (uint8_t i = 0; i < settings.sensorCount; i++) {
+    config.hash = (config.hash ^ settings.sensors[i]) * 16777619u;
+  }
+}
+
+void buildConfigs() {
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    buildConfig(robots[i]);
+  }
+}
+
+// Publishes the cached config if the broker doesn't have this version of it.
+// Retained, so reconnects don't need it again.
+// The entity configs follow it, see updateEntityConfigs().
+void updateConfig(Robot &robot) {
+  DiscoveryConfig &config = robot.config;
+  if (!mqttLink.up || config.failed) {
+    return;
+  }
+  if (config.sentHash == config.hash) {
+    updateEntityConfigs(robot);
+    return;
+  }
+  if (publishPayload(robot.configTopic.name, (const uint8_t *)config.payload, config.length, MessageConfig)) {
+    DLOG("Reporting config: %.*s\n", config.length, config.payload);
+    config.sentHash = config.hash;
+    robot.entityConfigsDue = (1ul << SENSOR_ENTITIES) - 1;
+  }
+}
+
+bool isCharging(const RoombaState &state) {
+  return state.chargingState == Roomba::ChargeStateReconditioningCharging
+  || state.chargingState == Roomba::ChargeStateFullCharging
+  || state.chargingState == Roomba::ChargeStateTrickleCharging;
+}
+
+uint8_t batteryLevel(const Battery &battery) {
+  return battery.valid ? lround(battery.soc * 100) : 0;
+}
+
+// Fixed layout of the binary state, little endian. New fields only ever go on
+// the end, and the version goes up whenever the meaning of a field changes.
+#define BINARY_STATE_VERSION 1
+
+typedef enum {
+  BinaryStateCleaning = 0x1,
+  BinaryStateDocked   = 0x2,
+  BinaryStateCharging = 0x4,
+} BinaryStateFlags;
+
+typedef struct {
+  uint8_t version;       // BINARY_STATE_VERSION
+  uint8_t flags;         // BinaryStateFlags
+  uint8_t chargingState; // One of Roomba::ChargeState
+  uint8_t batteryLevel;  // %
+  uint16_t voltage;      // mV
+  int16_t current;       // mA
+  uint16_t charge;       // mAh
+  uint16_t capacity;     // mAh
+  int16_t distance;      // mm since the previous sensor frame
+} BinaryState;
+
+static_assert(sizeof(BinaryState) == 14, "the binary state layout must not change");
+
+// Compares against the state as it was last published, to tell when it's worth publishing again
+bool statusStateChanged(const Robot &robot) {
+  const RoombaState &state = robot.state;
+  const RoombaState &lastSentState = robot.lastSentState;
+  return state.cleaning != lastSentState.cleaning
+  || state.docked != lastSentState.docked
+  || isCharging(state) != isCharging(lastSentState)
+  || state.batteryLow != lastSentState.batteryLow;
+}
+
+bool statusValuesChanged(const Robot &robot) {
+  const RoombaState &state = robot.state;
+  const RoombaState &lastSentState = robot.lastSentState;
+  return abs(state.current - lastSentState.current) >= settings.currentDelta
+  || abs(state.voltage - lastSentState.voltage) >= settings.voltageDelta
+  || abs(state.charge - lastSentState.charge) >= settings.chargeDelta;
+}
+
+// Publishes the state in the BinaryState layout, for consumers that would
+// rather not parse JSON
+void sendBinaryStatus(const Robot &robot) {
+  const RoombaState &state = robot.state;
+  BinaryState payload;
+  payload.version = BINARY_STATE_VERSION;
+  payload.flags = (state.cleaning ? BinaryStateCleaning : 0)
+    | (state.docked ? BinaryStateDocked : 0)
+    | (isCharging(state) ? BinaryStateCharging : 0);
+  payload.chargingState = state.chargingState;
+  payload.batteryLevel = batteryLevel(robot.battery);
+  payload.voltage = state.voltage;
+  payload.current = state.current;
+  payload.charge = state.charge;
+  payload.capacity = state.capacity;
+  payload.distance = state.distance;
+  publishPayload(robot.binaryStateTopic.name, (const uint8_t *)&payload, sizeof(payload), MessageState);
+}
+
+// Queued even while MQTT is disconnected, the latest state goes out on reconnect
+void sendStatus(Robot &robot) {
+  const RoombaState &state = robot.state;
+  StaticJsonDocument<JSON_OBJECT_SIZE(11)> root;
+  root["battery_level"] = batteryLevel(robot.battery);
+  root["battery_low"] = state.batteryLow;
+  root["time_to_empty"] = minutesToEmpty(robot.battery);
+  root["time_to_full"] = minutesToFull(robot.battery);
+  root["cleaning"] = state.cleaning;
+  root["docked"] = state.docked;
+  root["charging"] = isCharging(state);
+  root["voltage"] = state.voltage;
+  root["current"] = state.current;
+  root["charge"] = state.charge;
+  const char *curState = "idle";
+  if (state.docked) {
     curState = "docked";
   } else {
-    if (roombaState.cleaning) {
+    if (state.cleaning) {
       curState = "cleaning";
     }
   }
   root["state"] = curState;
-  String jsonStr;
-  serializeJson(root, jsonStr);
-  DLOG("Reporting status: %s\n", jsonStr.c_str());
-  mqttClient.publish(getMQTTTopic(stateTopic), jsonStr.c_str());
+  publishJson(robot.stateTopic.name, root, MessageState);
+  DLOG("Reporting status: %s\n", mqttPayload);
+#ifdef MQTT_BINARY_STATE
+  sendBinaryStatus(robot);
+#endif
+  robot.lastSentState = state;
+}
+
+// WiFi associates in the background, so an attempt only starts it. The retry
+// delay is how long it gets before starting over.
+void updateWiFi() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  if (connected) {
+    if (!wifiLink.up) {
+      DLOG("WiFi connected\n");
+      linkUp(wifiLink);
+    }
+    return;
+  }
+  if (wifiLink.up) {
+    DLOG("WiFi lost\n");
+    linkDown(wifiLink);
+    // The automatic reconnect gets the first go
+    backOff(wifiLink, WIFI_CONNECT_TIMEOUT, WIFI_BACKOFF_MAX);
+  } else if (retryDue(wifiLink)) {
+    DLOG("Still no WiFi, starting over\n");
+    WiFi.disconnect();
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+    backOff(wifiLink, WIFI_CONNECT_TIMEOUT, WIFI_BACKOFF_MAX);
+  }
+}
+
+// PubSubClient can only connect synchronously, so each attempt blocks for up
+// to MQTT_CONNECT_TIMEOUT. Its own lookup of the server name has no timeout, so
+// the name is resolved first, which can take as long again. The backoff keeps
+// that from happening often.
+void updateMQTT() {
+  if (mqttLink.up) {
+    if (mqttClient.connected()) {
+      return;
+    }
+    DLOG("MQTT lost\n");
+    linkDown(mqttLink);
+  }
+  if (!wifiLink.up || !retryDue(mqttLink)) {
+    return;
+  }
+  DLOG("Attempting MQTT connection...\n");
+  IPAddress address;
+  if (!WiFi.hostByName(settings.mqttServer, address, MQTT_CONNECT_TIMEOUT)) {
+    backOff(mqttLink, MQTT_BACKOFF_MIN, MQTT_BACKOFF_MAX);
+    DLOG("Can't resolve %s, try again in %lums\n", settings.mqttServer, mqttLink.retryDelay);
+    return;
+  }
+  mqttClient.setServer(address, settings.mqttPort);
+  if (!mqttClient.connect(HOSTNAME, settings.mqttUser, settings.mqttPassword)) {
+    backOff(mqttLink, MQTT_BACKOFF_MIN, MQTT_BACKOFF_MAX);
+    DLOG("MQTT failed rc=%d try again in %lums\n", mqttClient.state(), mqttLink.retryDelay);
+    return;
+  }
+  DLOG("MQTT connected\n");
+  if (mqttLink.wasUp) {
+    loopStats.reconnects++; // The first connect after boot isn't a reconnect
+  }
+  linkUp(mqttLink);
+  // Clean session, so the subscriptions are gone every time
+  mqttClient.subscribe(settingsSetTopic.name);
+  mqttClient.subscribe(discoveryStatusTopic.name);
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    mqttClient.subscribe(robots[i].commandTopic.name);
+    mqttClient.subscribe(robots[i].scheduleSetTopic.name);
+  }
+}
+
+void updateConnections() {
+  updateWiFi();
+  updateMQTT();
 }
 
-int lastStateMsgTime = 0;
+int lastStreamCheckTime = 0;
 int lastWakeupTime = 0;
-int lastConnectTime = 0;
-int configLoop = 0;
 
 void loop() {
+  uint32_t loopStart = ESP.getCycleCount();
+
   // Important callbacks that _must_ happen every cycle
-  ArduinoOTA.handle();
+  bool connected = startupStage == StartupConnected;
+  if (connected) {
+    ArduinoOTA.handle();
+  }
+  uint32_t stageStart = recordLoopStage(LoopStageOTA, loopStart);
   yield();
-  Debug.handle();
+  if (connected) {
+    Debug.handle();
+    drainLog(LOG_DRAIN_BUDGET);
+  }
+  stageStart = recordLoopStage(LoopStageDebug, stageStart);
 
   // Skip all other logic if we're running an OTA update
   if (OTAStarted) {
     return;
   }
 
+  updateConnections();
+  updateStartup();
+  updateADC();
+
   long now = millis();
-  // If MQTT client can't connect to broker, then reconnect every 30 seconds
-  if ((now - lastConnectTime) > 30000) {
-    lastConnectTime = now;
-    if (!mqttClient.connected()) {
-      DLOG("Reconnecting MQTT\n");
-      reconnect();
-      sendConfig();
-    } else {
-      // resend config every now and then to reconfigure entity e.g. in case homeassistant has been restarted
-      if (configLoop == 19) {
-        sendConfig();
-        configLoop = 0;
-      } else {
-        configLoop++;
-      }
-    }
-  }
-  // Wakeup the roomba at fixed intervals - every 50 seconds
-  if (now - lastWakeupTime > 50000) {
+  // Wakeup the roombas at fixed intervals - every 50 seconds
+  bool wakeupDue = now - lastWakeupTime > 50000;
+  bool streamCheckDue = now - lastStreamCheckTime > 10000;
+  if (wakeupDue) {
     lastWakeupTime = now;
-    if (!roombaState.cleaning) {
-      if (roombaState.docked) {
-        wakeOnDock();
+  }
+  if (streamCheckDue) {
+    lastStreamCheckTime = now;
+  }
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    Robot &robot = robots[i];
+    RoombaState &state = robot.state;
+    if (wakeupDue) {
+      if (!state.cleaning) {
+        if (state.docked) {
+          wakeOnDock(robot);
+        } else {
+          // wakeOffDock(robot);
+          wakeup(robot);
+        }
       } else {
-        // wakeOffDock();
-        wakeup();
+        wakeup(robot);
       }
-    } else {
-      wakeup();
     }
-  }
-  // Report the status over mqtt at fixed intervals
-  if (now - lastStateMsgTime > 10000) {
-    lastStateMsgTime = now;
-    if (now - roombaState.timestamp > 30000 || roombaState.sent) {
-      DLOG("Roomba state already sent (%.1fs old)\n", (now - roombaState.timestamp)/1000.0);
+    // Request the stream again if the Roomba stopped sending it
+    if (streamCheckDue && now - state.timestamp > (long)stateStaleTimeout()) {
+      DLOG("Roomba %d state is stale (%.1fs old)\n", i, (now - state.timestamp)/1000.0);
       DLOG("Request stream\n");
-      roomba.stream(sensors, sizeof(sensors));
-    } else {
-      sendStatus();
-      roombaState.sent = true;
+      requestStream(robot);
+      // It may have been reset or run flat, and lost its songs with it
+      robot.songSlots = 0;
+    }
+    updateSchedule(robot);
+    updateConfig(robot);
+    updateEntities(robot);
+    // Report the status over mqtt as soon as it changes, otherwise as a heartbeat
+    if (!state.sent) {
+      long sinceLastState = now - robot.lastStateMsgTime;
+      if (statusStateChanged(robot)
+          || (sinceLastState > (long)settings.statusMinInterval && statusValuesChanged(robot))
+          || sinceLastState > heartbeatInterval()) {
+        robot.lastStateMsgTime = now;
+        sendStatus(robot);
+        state.sent = true;
+      }
     }
+  }
+  if (streamCheckDue) {
     sleepIfNecessary();
   }
+  updateDutyCycle();
 
-  readSensorPacket();
+  // Report loop stats
+  if (now - lastStatsTime > settings.statsInterval && mqttClient.connected()) {
+    lastStatsTime = now;
+    sendStats();
+  }
+  stageStart = recordLoopStage(LoopStageTimers, stageStart);
+
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    runCommandQueue(robots[i]);
+  }
+  stageStart = recordLoopStage(LoopStageCommands, stageStart);
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    readSensorPacket(robots[i]);
+    updateSensorMode(robots[i]);
+    checkLink(robots[i]);
+  }
+  for (uint8_t i = 0; i < ROBOT_COUNT; i++) {
+    flushHistory(robots[i]);
+  }
+  stageStart = recordLoopStage(LoopStageSensors, stageStart);
+  drainPublishQueue(MQTT_QUEUE_DRAIN);
   mqttClient.loop();
+  recordLoopStage(LoopStageMQTT, stageStart);
+  if (restartPending) {
+    // The new settings go out first
+    flushPublishQueue();
+    flushLog();
+    delay(100);
+    ESP.restart();
+  }
+
+  recordLoopLatency(recordLoopStage(LoopStageLoop, loopStart) - loopStart);
 }
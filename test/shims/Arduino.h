@@ -0,0 +1,89 @@
+// Arduino.h
+//
+// Just enough of the Arduino core to build the Roomba library on the host, for the
+// native environment in platformio.ini. HardwareSerial is a mock: tests feed it the
+// bytes the Roomba would send, and it keeps the bytes written to it.
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using std::min;
+using std::max;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+inline unsigned long micros()
+{
+  using namespace std::chrono;
+  return (unsigned long)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+inline void delay(unsigned long) {}
+inline void yield() {}
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t ch) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size)
+  {
+    for (size_t i = 0; i < size; i++)
+      write(buffer[i]);
+    return size;
+  }
+  virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+class HardwareSerial : public Stream
+{
+public:
+  HardwareSerial() : baud(0), writes(0), _readIndex(0) {}
+
+  void begin(unsigned long rate) { baud = rate; }
+
+  /// Queues bytes for read() as if they had arrived from the Roomba
+  void feed(const uint8_t* data, size_t len) { rx.insert(rx.end(), data, data + len); }
+
+  /// Forgets everything fed and written so far
+  void clear() { rx.clear(); tx.clear(); writes = 0; _readIndex = 0; }
+
+  int available() { return (int)(rx.size() - _readIndex); }
+  int read() { return _readIndex < rx.size() ? rx[_readIndex++] : -1; }
+  int peek() { return _readIndex < rx.size() ? rx[_readIndex] : -1; }
+  size_t write(uint8_t ch) { writes++; tx.push_back(ch); return 1; }
+  size_t write(const uint8_t* buffer, size_t size) { writes++; tx.insert(tx.end(), buffer, buffer + size); return size; }
+
+  unsigned long        baud; /// Rate given to the last begin()
+  std::vector<uint8_t> rx;   /// Bytes fed to the port
+  std::vector<uint8_t> tx;   /// Bytes written to the port
+  unsigned long        writes; /// Calls to write(), however many bytes each
+
+private:
+  size_t               _readIndex; /// Next byte of rx for read()
+};
+
+extern HardwareSerial Serial;
+
+#endif
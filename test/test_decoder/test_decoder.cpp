@@ -0,0 +1,486 @@
+// test_decoder.cpp
+//
+// Host tests for the Roomba stream decoder. Run them with
+//   pio test -e native
+// Streams are fed through the mock HardwareSerial in test/shims and decoded by
+// pollSensors(), as they would be on the ESP: clean, with the text the Roomba sends
+// at startup, with false starts, with every single byte of a frame corrupted, and
+// with random corruption. The decoder must not allocate any memory while it runs.
+// The batching of commands into single writes is checked against the same mock.
+
+#include <Roomba.h>
+#include <unity.h>
+#include <stdlib.h>
+#include <new>
+
+HardwareSerial Serial;
+
+// Counts heap allocations while countAllocations is set
+static bool          countAllocations = false;
+static unsigned long allocations = 0;
+
+void* operator new(size_t size)
+{
+  if (countAllocations)
+    allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// The packets asked for in stream(). 19 data bytes, so the size byte is 19 as well,
+// the same as the byte that starts a frame
+static const uint8_t packetIDs[] = { 7, 19, 21, 22, 23, 25, 26 };
+#define FRAME_SIZE 22 // 19, size, the IDs and their data, checksum
+
+// The values carried by one frame
+typedef struct
+{
+  uint8_t  bumps;
+  int16_t  distance;
+  uint8_t  chargingState;
+  uint16_t voltage;
+  int16_t  current;
+  int16_t  charge;
+  uint16_t capacity;
+} Frame;
+
+#define MAX_FRAMES 64
+#define MAX_STREAM (MAX_FRAMES * FRAME_SIZE * 2)
+
+static Roomba  roomba(&Serial, Roomba::Baud115200);
+static Frame   decoded[MAX_FRAMES]; // Frames pollSensors() returned, in order
+static int     decodedCount;
+
+// A small deterministic generator, so a failing fuzz round can be replayed
+static uint32_t randomState;
+
+static uint32_t nextRandom()
+{
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint8_t* put16(uint8_t* p, uint16_t value)
+{
+  *p++ = value >> 8;
+  *p++ = value & 0xff;
+  return p;
+}
+
+// Writes f as the Roomba would send it, returns the number of bytes written
+static size_t buildFrame(uint8_t* dest, const Frame& f)
+{
+  uint8_t* p = dest;
+  *p++ = 19;
+  *p++ = sizeof(packetIDs) + 12;
+  *p++ = 7;  *p++ = f.bumps;
+  *p++ = 19; p = put16(p, f.distance);
+  *p++ = 21; *p++ = f.chargingState;
+  *p++ = 22; p = put16(p, f.voltage);
+  *p++ = 23; p = put16(p, f.current);
+  *p++ = 25; p = put16(p, f.charge);
+  *p++ = 26; p = put16(p, f.capacity);
+  uint8_t sum = 0;
+  for (uint8_t* q = dest; q < p; q++)
+    sum += *q;
+  *p++ = 256 - sum;
+  return p - dest;
+}
+
+// A frame whose distance tells it apart from the others. The voltage and charge
+// carry a 19 in their data, so they look like the start of a frame
+static Frame makeFrame(int16_t index)
+{
+  Frame f;
+  f.bumps = index & 0x0f;
+  f.distance = index;
+  f.chargingState = Roomba::ChargeStateTrickleCharging;
+  f.voltage = 0x3b13;
+  f.current = -1200 + index;
+  f.charge = 0x1313;
+  f.capacity = 2696;
+  return f;
+}
+
+static Frame randomFrame(int16_t index)
+{
+  Frame f;
+  f.bumps = nextRandom() & 0x1f;
+  f.distance = index;
+  f.chargingState = nextRandom() % 6;
+  f.voltage = nextRandom();
+  f.current = nextRandom();
+  f.charge = nextRandom();
+  f.capacity = nextRandom();
+  return f;
+}
+
+static bool sameFrame(const Frame& a, const Frame& b)
+{
+  return a.bumps == b.bumps && a.distance == b.distance && a.chargingState == b.chargingState
+    && a.voltage == b.voltage && a.current == b.current && a.charge == b.charge && a.capacity == b.capacity;
+}
+
+// Decodes everything fed to Serial into decoded[], counting any allocations
+static void decodeAll()
+{
+  Roomba::SensorValues values;
+  countAllocations = true;
+  while (Serial.available())
+  {
+    if (roomba.pollSensors(&values) && decodedCount < MAX_FRAMES)
+    {
+      Frame& f = decoded[decodedCount++];
+      f.bumps = values.bumpsAndWheelDrops;
+      f.distance = values.distance;
+      f.chargingState = values.chargingState;
+      f.voltage = values.voltage;
+      f.current = values.current;
+      f.charge = values.charge;
+      f.capacity = values.capacity;
+    }
+  }
+  countAllocations = false;
+}
+
+// A fresh decoder, as if the stream had just been requested
+void setUp()
+{
+  roomba = Roomba(&Serial, Roomba::Baud115200);
+  roomba.stream(packetIDs, sizeof(packetIDs));
+  Serial.clear();
+  decodedCount = 0;
+  allocations = 0;
+}
+
+void tearDown() {}
+
+static void test_clean_stream()
+{
+  uint8_t frame[FRAME_SIZE];
+  for (int i = 0; i < MAX_FRAMES; i++)
+    Serial.feed(frame, buildFrame(frame, makeFrame(i - MAX_FRAMES / 2)));
+  decodeAll();
+
+  TEST_ASSERT_EQUAL_INT(MAX_FRAMES, decodedCount);
+  for (int i = 0; i < MAX_FRAMES; i++)
+    TEST_ASSERT_TRUE(sameFrame(makeFrame(i - MAX_FRAMES / 2), decoded[i]));
+  const Roomba::StreamStats& stats = roomba.streamStats();
+  TEST_ASSERT_EQUAL_UINT32(MAX_FRAMES, stats.frames);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.checksumErrors);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.frameErrors);
+  TEST_ASSERT_EQUAL_UINT32(MAX_FRAMES * FRAME_SIZE, stats.bytes);
+  TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+// What a Roomba 500 sends when it boots and while it charges, with frames in between
+static void test_startup_text()
+{
+  static const char* text[] = {
+    "bl-start\r\nSTR730\r\nbootloader id: #x47175347 DBCFFFFF\r\nbootloader info rev: #xF000\r\n",
+    "bootloader rev: #x0001\r\n2007-05-14-1715-L   \r\nRoomba by iRobot!\r\nstr730\r\n2010-08-04-1659-L   \r\n",
+    "battery-current-zero 252\r\n",
+    "bat:   min 2  sec 25  mV 15123  mA 1111  tenths-deg-C 283  mAH 2407  state 5\r\n",
+  };
+  uint8_t frame[FRAME_SIZE];
+  for (int i = 0; i < 4; i++)
+  {
+    Serial.feed((const uint8_t*)text[i], strlen(text[i]));
+    Serial.feed(frame, buildFrame(frame, makeFrame(i)));
+  }
+  decodeAll();
+
+  TEST_ASSERT_EQUAL_INT(4, decodedCount);
+  for (int i = 0; i < 4; i++)
+    TEST_ASSERT_TRUE(sameFrame(makeFrame(i), decoded[i]));
+  TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+// A 19 followed by the right size and first packet ID, right before a real frame
+static void test_false_start()
+{
+  static const uint8_t falseStart[] = { 19, sizeof(packetIDs) + 12, 7 };
+  uint8_t frame[FRAME_SIZE];
+  Serial.feed(falseStart, sizeof(falseStart));
+  Serial.feed(frame, buildFrame(frame, makeFrame(1)));
+  Serial.feed(frame, buildFrame(frame, makeFrame(2)));
+  decodeAll();
+
+  TEST_ASSERT_EQUAL_INT(2, decodedCount);
+  TEST_ASSERT_TRUE(sameFrame(makeFrame(1), decoded[0]));
+  TEST_ASSERT_TRUE(sameFrame(makeFrame(2), decoded[1]));
+  TEST_ASSERT_TRUE(roomba.streamStats().rescans >= 1);
+  TEST_ASSERT_EQUAL_UINT32(0, allocations);
+}
+
+// Whichever byte of a frame is corrupted, only that frame is lost
+static void test_single_byte_corruption()
+{
+  uint8_t frame[FRAME_SIZE];
+  for (int offset = 0; offset < FRAME_SIZE; offset++)
+  {
+    for (int bit = 0; bit < 8; bit++)
+    {
+      setUp();
+      size_t len = buildFrame(frame, makeFrame(0));
+      frame[offset] ^= 1 << bit;
+      Serial.feed(frame, len);
+      Serial.feed(frame, buildFrame(frame, makeFrame(1)));
+      Serial.feed(frame, buildFrame(frame, makeFrame(2)));
+      decodeAll();
+
+      TEST_ASSERT_EQUAL_INT(2, decodedCount);
+      TEST_ASSERT_TRUE(sameFrame(makeFrame(1), decoded[0]));
+      TEST_ASSERT_TRUE(sameFrame(makeFrame(2), decoded[1]));
+      TEST_ASSERT_EQUAL_UINT32(0, allocations);
+    }
+  }
+}
+
+typedef enum
+{
+  CorruptFlip,
+  CorruptDrop,
+  CorruptInsert,
+} Corruption;
+
+// Random frames with random corruption, at most one per frame. A flipped bit always
+// breaks the checksum, so nothing but the unbroken frames may come out, in order.
+// A dropped or inserted byte can now and then leave a frame that looks good, which
+// may cost the frame after it too, so then all that is checked is that the decoder
+// keeps delivering frames.
+static void fuzz(Corruption corruption, uint32_t seed)
+{
+  static uint8_t stream[MAX_STREAM];
+  static int8_t  owner[MAX_STREAM]; // Frame each byte belongs to, -1 for inserted bytes
+  static bool    broken[MAX_FRAMES];
+  static Frame   sent[MAX_FRAMES];
+  randomState = seed;
+
+  for (int round = 0; round < 200; round++)
+  {
+    setUp();
+    size_t len = 0;
+    for (int i = 0; i < MAX_FRAMES; i++)
+    {
+      sent[i] = randomFrame(i);
+      size_t n = buildFrame(stream + len, sent[i]);
+      memset(owner + len, i, n);
+      len += n;
+      broken[i] = false;
+    }
+
+    int corruptions = 1 + nextRandom() % 8;
+    for (int c = 0; c < corruptions; c++)
+    {
+      size_t at = nextRandom() % len;
+      if (owner[at] >= 0 && broken[owner[at]])
+        continue;
+      switch (corruption)
+      {
+      case CorruptFlip:
+        stream[at] ^= 1 << (nextRandom() % 8);
+        broken[owner[at]] = true;
+        break;
+      case CorruptDrop:
+        broken[owner[at]] = true;
+        memmove(stream + at, stream + at + 1, len - at - 1);
+        memmove(owner + at, owner + at + 1, len - at - 1);
+        len--;
+        break;
+      case CorruptInsert:
+        // Breaks the frame it lands in, but not one it lands just before
+        if (owner[at] >= 0 && at > 0 && owner[at - 1] == owner[at])
+          broken[owner[at]] = true;
+        memmove(stream + at + 1, stream + at, len - at);
+        memmove(owner + at + 1, owner + at, len - at);
+        stream[at] = nextRandom();
+        owner[at] = -1;
+        len++;
+        break;
+      }
+    }
+
+    // Feed it in randomly sized pieces, like a serial port would deliver it
+    for (size_t fed = 0; fed < len; )
+    {
+      size_t n = min(len - fed, (size_t)(1 + nextRandom() % 40));
+      Serial.feed(stream + fed, n);
+      fed += n;
+      decodeAll();
+    }
+
+    int unbroken = 0;
+    for (int i = 0; i < MAX_FRAMES; i++)
+      unbroken += !broken[i];
+    TEST_ASSERT_EQUAL_UINT32(len, roomba.streamStats().bytes);
+    TEST_ASSERT_EQUAL_UINT32(0, allocations);
+    if (corruption == CorruptFlip)
+    {
+      TEST_ASSERT_EQUAL_INT(unbroken, decodedCount);
+      int next = 0;
+      for (int i = 0; i < MAX_FRAMES; i++)
+      {
+        if (broken[i])
+          continue;
+        TEST_ASSERT_TRUE(sameFrame(sent[i], decoded[next]));
+        next++;
+      }
+    }
+    else
+      TEST_ASSERT_TRUE(decodedCount >= unbroken - corruptions);
+  }
+}
+
+static void test_fuzz_flips()
+{
+  fuzz(CorruptFlip, 0x1d872b41);
+}
+
+static void test_fuzz_drops()
+{
+  fuzz(CorruptDrop, 0x5bd1e995);
+}
+
+static void test_fuzz_inserts()
+{
+  fuzz(CorruptInsert, 0x9e3779b9);
+}
+
+// Only a HardwareSerial can be restarted at another rate
+static void test_serial_baud()
+{
+  uint8_t frame[FRAME_SIZE];
+  Serial.feed(frame, buildFrame(frame, makeFrame(0)) - 5);
+  decodeAll();
+  TEST_ASSERT_TRUE(roomba.serialBaud(Roomba::Baud19200));
+  TEST_ASSERT_EQUAL_UINT32(19200, Serial.baud);
+  TEST_ASSERT_EQUAL_UINT32(0, Serial.tx.size()); // Nothing is sent to the Roomba
+
+  // The half frame from the old rate is not finished by the bytes at the new one
+  Serial.feed(frame, buildFrame(frame, makeFrame(1)));
+  decodeAll();
+  TEST_ASSERT_EQUAL_INT(1, decodedCount);
+  TEST_ASSERT_TRUE(sameFrame(makeFrame(1), decoded[0]));
+
+  Roomba other((Stream*)&Serial, Roomba::Baud115200);
+  TEST_ASSERT_FALSE(other.serialBaud(Roomba::Baud19200));
+}
+
+static void assertWritten(const uint8_t* expected, size_t len)
+{
+  TEST_ASSERT_EQUAL_UINT32(len, Serial.tx.size());
+  TEST_ASSERT_TRUE(memcmp(expected, Serial.tx.data(), len) == 0);
+}
+
+// The queued stream reset and request, as startRobot() has them sent
+static void test_batch_one_write()
+{
+  roomba.beginBatch();
+  roomba.stream(NULL, 0);
+  roomba.stream(packetIDs, sizeof(packetIDs));
+  TEST_ASSERT_EQUAL_UINT32(0, Serial.writes);
+  roomba.commit();
+
+  static const uint8_t expected[] = { 148, 0, 148, 7, 7, 19, 21, 22, 23, 25, 26 };
+  TEST_ASSERT_EQUAL_UINT32(1, Serial.writes);
+  assertWritten(expected, sizeof(expected));
+
+  // And the decoder still knows what the frames look like
+  uint8_t frame[FRAME_SIZE];
+  Serial.feed(frame, buildFrame(frame, makeFrame(1)));
+  decodeAll();
+  TEST_ASSERT_EQUAL_INT(1, decodedCount);
+}
+
+// Each command is one write of its own, outside a batch
+static void test_unbatched()
+{
+  roomba.playSong(1);
+  roomba.playSong(2);
+  static const uint8_t expected[] = { 141, 1, 141, 2 };
+  TEST_ASSERT_EQUAL_UINT32(2, Serial.writes);
+  assertWritten(expected, sizeof(expected));
+}
+
+// Only the outermost commit() writes
+static void test_batch_nesting()
+{
+  roomba.beginBatch();
+  roomba.beginBatch();
+  roomba.playSong(1);
+  roomba.commit();
+  TEST_ASSERT_EQUAL_UINT32(0, Serial.writes);
+  roomba.playSong(2);
+  roomba.commit();
+  static const uint8_t expected[] = { 141, 1, 141, 2 };
+  TEST_ASSERT_EQUAL_UINT32(1, Serial.writes);
+  assertWritten(expected, sizeof(expected));
+}
+
+// A batch that outgrows ROOMBA_TX_BUFFER_SIZE is written early, and nothing is lost
+static void test_batch_overflow()
+{
+  uint8_t expected[200];
+  roomba.beginBatch();
+  for (int i = 0; i < 100; i++)
+  {
+    roomba.playSong(i % 16);
+    expected[i * 2] = 141;
+    expected[i * 2 + 1] = i % 16;
+  }
+  TEST_ASSERT_EQUAL_UINT32(1, Serial.writes);
+  TEST_ASSERT_EQUAL_UINT32(ROOMBA_TX_BUFFER_SIZE, Serial.tx.size());
+  roomba.commit();
+  TEST_ASSERT_EQUAL_UINT32(2, Serial.writes);
+  assertWritten(expected, sizeof(expected));
+}
+
+// A query goes out with what was staged before it, even in a batch
+static void test_batch_query()
+{
+  static const uint8_t response[] = { 3 };
+  Serial.feed(response, sizeof(response));
+  roomba.beginBatch();
+  roomba.playSong(1);
+  uint8_t bumps = 0;
+  TEST_ASSERT_TRUE(roomba.getSensors(Roomba::SensorBumpsAndWheelDrops, &bumps, 1));
+  TEST_ASSERT_EQUAL_INT(3, bumps);
+  roomba.commit();
+  static const uint8_t expected[] = { 141, 1, 142, 7 };
+  TEST_ASSERT_EQUAL_UINT32(1, Serial.writes);
+  assertWritten(expected, sizeof(expected));
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_clean_stream);
+  RUN_TEST(test_startup_text);
+  RUN_TEST(test_false_start);
+  RUN_TEST(test_single_byte_corruption);
+  RUN_TEST(test_fuzz_flips);
+  RUN_TEST(test_fuzz_drops);
+  RUN_TEST(test_fuzz_inserts);
+  RUN_TEST(test_serial_baud);
+  RUN_TEST(test_batch_one_write);
+  RUN_TEST(test_unbatched);
+  RUN_TEST(test_batch_nesting);
+  RUN_TEST(test_batch_overflow);
+  RUN_TEST(test_batch_query);
+  return UNITY_END();
+}